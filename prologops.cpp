@@ -40,6 +40,42 @@ We will start with some basic includes - <functional> is the important one
 
 #include <functional>
 #include <vector>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
 
 /* 
 Next we define a couple of basic types to represent data types and forward declare the Term type
@@ -63,22 +99,52 @@ etc.
  
 */
 
+/*
+A Ref is how one term refers to another. Normally it is simply a Term*. Built with PROLOGOPS_COMPRESSED_REFS, it is instead a 32-bit offset
+into a single heap that every term is allocated from ( see the Arena, below ), counted in 8 byte units so that the heap can reach 32GB. A
+list cell is mostly references, and halving them takes a term from 104 bytes to 64 - one cache line. Ref converts to and from Term* by
+itself, so code that reads or writes a reference looks the same in both builds: the base is added on the way out and taken off on the
+way in. Offset 0 is never handed out and stands for nullptr.
+*/
+
+#ifdef PROLOGOPS_COMPRESSED_REFS
+char* gHeapBase = nullptr;
+
+struct Ref
+{
+	uint32_t	mOffset;
+
+	Ref() = default;
+	Ref(Term* t) : mOffset(t == nullptr ? 0 : (uint32_t)(((char*)t - gHeapBase) >> 3)) {}
+	operator Term*() const { return mOffset == 0 ? nullptr : (Term*)(gHeapBase + ((size_t)mOffset << 3)); }
+	Term* operator->() const { return *this; }
+};
+#else
+typedef Term* Ref;
+#endif
+
+struct Lazy;
+
 struct Variable
 {
-	bool	mIsBound;
-	Term*	mReference;
+	bool		mIsBound;
+	Ref			mReference;
+	long long	mAge;
+	Lazy*		mLazy;			// the tail of a stream, see Force()
 };
 
 /* 
 If mIsBound is true, then mReference points to another Term. In classic implementations, unbound variables are more efficiently expressed by having them refer to themselves, but here using
-an explicit flag. The other type is an Atom: 
+an explicit flag. mAge records the order variables were created in - the WAM gets this for free by comparing heap addresses, but new() makes
+no such promise. The count is one for the whole process, so variables made by different threads or engines still compare the right way. The other type is an Atom: 
 */
 
 struct Atom
 {
 	char*	mName;
 	int		mArity;
-	Term*	mTerms[10];
+	bool	mBorrowed;		// belongs to a stream's chunk, see Force()
+	Ref		mTerms[10];
 };
 
 /* 
@@ -107,8 +173,19 @@ struct Term
 		Variable	mVariable;
 		Atom		mAtom;
 	};
+
+	static void* operator new(size_t Bytes);		// from the thread's Arena, see below
+	static void operator delete(void* t);
+#ifdef PROLOGOPS_COMPRESSED_REFS
+	static void* operator new[](size_t Bytes) { return operator new(Bytes); }
+	static void operator delete[](void* t, size_t Bytes);
+#endif
 };
 
+#ifdef PROLOGOPS_COMPRESSED_REFS
+static_assert(sizeof(Term) == 64, "a term with compressed references should fit a cache line, see Ref");
+#endif
+
 /* 
 So this gives us a very hacky and minimal way of expressing PROLOG's data structures. Everything is a Term - a dynamically typed element. There are two types of Terms are
 being considered here - Variables and Atoms. "Real" PROLOG, of course, has integers, floating point numbers and other types, but this is enough to apply the operational behaviour. 
@@ -116,17 +193,43 @@ The key operation in PROLOG is unification. This matches two Terms, taking unbou
 support this, we define a function Deref. In the case of a bound variable this will follow the chain of references until it hits either an Atom or an unbound variable: 
 */
 
+void Compress(Term* Root, Term* Target);
+Term* Force(Term* Tail);
+
+thread_local bool		gCompressChains = true;
+#ifdef PROLOGOPS_STATS
+thread_local long long	gDerefs = 0;
+thread_local long long	gDerefHops = 0;
+#endif
+
 Term* Deref(Term* Root)
 {
 	Term* t = Root;
+	int hops = 0;
 	while (t->mType == eVariable && t->mVariable.mIsBound)
 	{
 		t = t->mVariable.mReference;
+		hops++;
 	}
 
+#ifdef PROLOGOPS_STATS
+	gDerefs++;
+	gDerefHops += hops;
+#endif
+	if (hops > 1 && gCompressChains)
+	{
+		Compress(Root, t);
+	}
 	return t;
 }
 
+/*
+Every access to a variable walks its chain again, so a long chain is paid for over and over. Once a chain longer than one hop has been
+walked, Compress() ( below, as it needs the trail ) repoints each link straight at the end of the chain, so the next Deref is a single hop.
+Built with PROLOGOPS_STATS, gDerefHops / gDerefs gives the average chain length actually walked. Every step of every search goes through
+Deref(), so the counting is left out of a normal build.
+*/
+
 /* 
 We now define two std::functions. Together these are used to implement the operational semantics of PROLOG. 
 */
@@ -169,25 +272,51 @@ are multiple possible continuations. This then stores the following choice of co
 
 */
 
+void Unforce(Term* Tail);
+
 struct Trail
 {
-	std::vector<Term*>	mTrail;
+	struct Entry
+	{
+		Term*	mTerm;
+		Term*	mPrevious;
+	};
+
+	std::vector<Entry>	mTrail;
 	void Add(Term* t )
 	{
-		mTrail.push_back(t);
+		mTrail.push_back({ t, nullptr });
+	}
+
+	void Rebind(Term* t, Term* Target)
+	{
+		mTrail.push_back({ t, t->mVariable.mReference });
+		t->mVariable.mReference = Target;
 	}
 
 	void UnWind( int Index)
 	{
 		while (mTrail.size()  != Index)
 		{
-			mTrail.back()->mVariable.mIsBound = false;
+			Entry& e = mTrail.back();
+			if (e.mPrevious != nullptr)
+			{
+				e.mTerm->mVariable.mReference = e.mPrevious;
+			}
+			else
+			{
+				e.mTerm->mVariable.mIsBound = false;
+				if (e.mTerm->mVariable.mLazy != nullptr)
+				{
+					Unforce(e.mTerm);
+				}
+			}
 			mTrail.pop_back();
 		}
 	}
 };
 
-Trail gTrail;
+thread_local Trail gTrail;
 
 /* 
 The trail records the binding history of terms. As terms are bound, we add them to this trail ( the term is taken from Warren's Abstract Machine
@@ -208,6 +337,9 @@ loop(X) :- write(X),
 Each iteration will construct a new variable, even with the '!' which is the cut construct. 'cut' in PROLOG clears the Retry and prevents
 further backtracking. 
 
+gTrail is thread_local, so each thread is effectively its own engine - nothing else in the machine is shared, and several searches can run side
+by side as long as they don't bind the same variables.
+
 Bind has the obvious definition:
 */ 
 
@@ -218,19 +350,101 @@ void Bind(Term* t0, Term* t1)
 	gTrail.Add(t0);
 }
 
+/*
+Compressing a chain is also a mutation, so it has to be undone on backtracking just like a binding - the link may have been made after the
+choice point we return to. Rebind() trails the old reference as well as the variable, and UnWind() puts it back instead of unbinding. It costs
+a trail write per link, but only for chains that were actually long.
+*/
+
+void Compress(Term* Root, Term* Target)
+{
+	Term* t = Root;
+	while (t->mVariable.mReference != Target)
+	{
+		Term* next = t->mVariable.mReference;
+		gTrail.Rebind(t, Target);
+		t = next;
+	}
+}
+
 /* 
-When we want to restore the status of terms to an earlier point, we call UnWind() and unbind all the Terms from before this point. Now for
-the definition of Unify: 
+When we want to restore the status of terms to an earlier point, we call UnWind() and unbind all the Terms from before this point. 
+
+Every step of a search goes through Unify, which makes it the natural place to stop one. Each engine counts its inferences and gives up once
+it passes its limit, or once someone else sets its cancel flag. Giving up is simply not calling either K or R - with nothing left to call, the
+whole chain of continuations returns, and the caller can UnWind() the trail to tidy up.
+*/
+
+thread_local long long			gInferences = 0;
+thread_local long long			gInferenceLimit = LLONG_MAX;
+thread_local std::atomic<bool>*	gCancel = nullptr;
+thread_local long long			gSliceEnd = LLONG_MAX;		// see Resume()
+thread_local int				gShardsLost = 0;			// see ShardedCall()
+
+void Yield();
+
+bool Halted()
+{
+	if (++gInferences >= gSliceEnd)
+	{
+		Yield();
+	}
+	return gInferences > gInferenceLimit || (gCancel != nullptr && gCancel->load(std::memory_order_relaxed));
+}
+
+/*
+Now for the definition of Unify: 
 */ 
 
-void UnifyTerms(Term** t0s, Term** t1s, Continuation K, Retry R, int Arity);
+void UnifyTerms(Ref* t0s, Ref* t1s, Continuation K, Retry R, int Arity);
 
 void Unify(Term* t0, Term* t1, Continuation K, Retry R)
 {
+	if (Halted())
+	{
+		return;
+	}
+
 	Term* t0dr = Deref(t0);
 	Term* t1dr = Deref(t1);
 
-	if (t0dr->mType == eVariable)
+	bool lazy0 = t0dr->mType == eVariable && t0dr->mVariable.mLazy != nullptr;
+	bool lazy1 = t1dr->mType == eVariable && t1dr->mVariable.mLazy != nullptr;
+	if ((lazy0 || lazy1) && t0dr != t1dr)
+	{
+		if (lazy0 && !lazy1 && t1dr->mType == eVariable)
+		{
+			Bind(t1dr, t0dr);
+			K(R);
+			return;
+		}
+		if (lazy1 && !lazy0 && t0dr->mType == eVariable)
+		{
+			Bind(t0dr, t1dr);
+			K(R);
+			return;
+		}
+		t0dr = lazy0 ? Force(t0dr) : t0dr;
+		t1dr = lazy1 ? Force(t1dr) : t1dr;
+	}
+
+	if (t0dr == t1dr)
+	{
+		K(R);
+	}
+	else if (t0dr->mType == eVariable && t1dr->mType == eVariable)
+	{
+		if (t0dr->mVariable.mAge > t1dr->mVariable.mAge)
+		{
+			Bind(t0dr, t1dr);
+		}
+		else
+		{
+			Bind(t1dr, t0dr);
+		}
+		K(R);
+	}
+	else if (t0dr->mType == eVariable)
 	{
 		Bind(t0dr, t1dr);
 		K(R);
@@ -252,14 +466,16 @@ void Unify(Term* t0, Term* t1, Continuation K, Retry R)
 }
 
 /* 
- So, given two terms they are first dereferenced ( Deref ). If either term is an unbound  variable, it is bound to the other, and we continue. If the
+ So, given two terms they are first dereferenced ( Deref ). If either term is an unbound  variable, it is bound to the other, and we continue. When
+ both are variables, the younger is bound to the older - fresh clause variables then point at the longer lived query variables rather than the
+ other way round, which keeps chains from forming in the first place ( and a variable unified with itself is left alone ). If the
  terms are both Atoms, their terms are matched,  providing the predicate name and arity match. If this is the case, then we backtrack to 
  an earlier state by calling retry. Unify terms calls unify on each of the sub-terms. If the Arity is 0, then we have successfully unified the 
  terms and we continue. Otherwise, we create a backtrack point to follow if we fail to unify the next term. This captures the current
  trail index. In this case, this retry will simply have the effect of unwinding the unification.  
  */
  
- void UnifyTerms(Term** t0s, Term** t1s, Continuation K, Retry R, int Arity)
+ void UnifyTerms(Ref* t0s, Ref* t1s, Continuation K, Retry R, int Arity)
 {
 	if (Arity == 0)
 	{
@@ -309,12 +525,263 @@ while( gCont != nullptr)
 And that, is basically, that - 150 lines without comments. With these definitions you can effectively implement PROLOG-like operational semantics in C++. Some utility functions: 
 */
 
+/*
+Terms are almost never freed, so there is no point asking malloc() for each one. Each thread instead takes them from its own Arena: a large
+block that is handed out in order and is never given back. Making a term costs a pointer bump, and the terms a search makes together sit
+together in memory. The few terms that are deleted - a memo's evicted answers, say - go onto the thread's free list, and the next terms made
+on that thread reuse them.
+
+Large blocks also mean large pages. A search chasing references through a heap of millions of terms misses the TLB on nearly every hop when
+the heap is mapped in 4KB pages, and hardly ever when it is mapped in 2MB ones. gHugePages picks how blocks are mapped: eHugePagesTransparent
+aligns each block to 2MB and asks the kernel to back it with a transparent huge page, and eHugePagesExplicit takes pages from the reserved
+hugetlbfs pool, falling back to transparent ones when the pool is empty. gArenaHugeBlocks counts the blocks that got explicit huge pages.
+
+On a machine with more than one NUMA node, memory on the other socket costs about half as much again to reach. A thread's blocks are bound
+to the node the thread is running on when it maps them, and the processes Distribute() forks are each pinned to a node in turn, so a worker
+keeps running next to its own terms. On a single node none of this changes anything and is skipped.
+*/
+
+enum HugePages
+{
+	eHugePagesOff,
+	eHugePagesTransparent,
+	eHugePagesExplicit
+};
+
+HugePages				gHugePages = eHugePagesTransparent;
+const size_t			gHugePage = 2 << 20;
+size_t					gArenaBlock = 2 << 20;
+std::atomic<long long>	gArenaBlocks(0);
+std::atomic<long long>	gArenaHugeBlocks(0);
+
+struct Arena
+{
+	char*	mNext;
+	char*	mEnd;
+	void*	mFree;		// deleted terms, each holding the next
+};
+
+thread_local Arena	gArena = { nullptr, nullptr, nullptr };
+thread_local long long	gTermBytes = 0;		// bytes of terms made, less those freed, by the search running here, see Memory()
+
+int Nodes()
+{
+	static int nodes = []() {
+		int n = 0;
+		while (access(("/sys/devices/system/node/node" + std::to_string(n)).c_str(), F_OK) == 0)
+		{
+			n++;
+		}
+		return std::max(n, 1);
+	}();
+	return nodes;
+}
+
+/*
+Local() binds a mapping to the node the calling thread is on. MPOL_PREFERRED rather than MPOL_BIND, so that a full node spills over to
+another rather than failing.
+*/
+
+void Local(void* Block, size_t Bytes)
+{
+	unsigned cpu = 0;
+	unsigned node = 0;
+	if (Nodes() > 1 && syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+	{
+		unsigned long mask = 1UL << node;
+		syscall(SYS_mbind, Block, Bytes, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+	}
+}
+
+/*
+PinToNode() restricts a thread - the calling one, or a whole process given its pid - to the CPUs of one node, read from the node's cpulist
+( ranges like 0-23,48-71 ). Only CPUs it may already run on are kept, so a taskset or cpuset the caller was started under still holds. If
+none of the node's CPUs are among them, or the kernel refuses, the thread is left where it was, PinToNode() says false and gUnpinned counts
+it.
+*/
+
+std::atomic<long long>	gUnpinned(0);
+
+bool PinToNode(int Node, pid_t Process = 0)
+{
+	std::ifstream in("/sys/devices/system/node/node" + std::to_string(Node) + "/cpulist");
+	std::string list;
+	cpu_set_t allowed;
+	if (!std::getline(in, list) || sched_getaffinity(Process, sizeof(allowed), &allowed) != 0)
+	{
+		gUnpinned++;
+		return false;
+	}
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	for (char* p = &list[0]; *p != '\0';)
+	{
+		long first = strtol(p, &p, 10);
+		long last = *p == '-' ? strtol(p + 1, &p, 10) : first;
+		for (long c = first; c <= last && c < CPU_SETSIZE; c++)
+		{
+			CPU_SET(c, &cpus);
+		}
+		if (*p == ',')
+		{
+			p++;
+		}
+		else if (*p != '\0')
+		{
+			break;
+		}
+	}
+	CPU_AND(&cpus, &cpus, &allowed);
+	if (CPU_COUNT(&cpus) == 0 || sched_setaffinity(Process, sizeof(cpus), &cpus) != 0)
+	{
+		gUnpinned++;
+		return false;
+	}
+	return true;
+}
+
+#ifdef PROLOGOPS_COMPRESSED_REFS
+
+/*
+With compressed references every block has to come from the one heap. Its 32GB of address space is reserved up front, inaccessible and
+costing nothing, and blocks are made usable one at a time as threads ask for them - on huge pages and on the thread's node, just as below.
+A block is mapped over its part of the reservation, on explicit huge pages if asked for and the pool has them and on ordinary ones if not.
+Nothing in the heap is ever given back to the system, and every array of terms has to come from it too, so a stream's chunk ( see Force() )
+returns its cells to the thread's free list when it is freed, one term at a time.
+*/
+
+const size_t			gHeapBytes = (size_t)32 << 30;
+std::atomic<size_t>		gHeapTop(gHugePage);		// the first page stays unused, so offset 0 is free for nullptr
+
+void* MapBlock(size_t Bytes)
+{
+	static char* heap = []() {
+		char* wide = (char*)mmap(nullptr, gHeapBytes + gHugePage, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (wide == MAP_FAILED)
+		{
+			throw std::bad_alloc();
+		}
+		gHeapBase = (char*)(((uintptr_t)wide + gHugePage - 1) & ~(uintptr_t)(gHugePage - 1));
+		return gHeapBase;
+	}();
+
+	Bytes = (Bytes + gHugePage - 1) & ~(gHugePage - 1);
+	size_t at = gHeapTop.fetch_add(Bytes);
+	if (at + Bytes > gHeapBytes)
+	{
+		throw std::bad_alloc();
+	}
+	char* block = heap + at;
+	bool huge = gHugePages == eHugePagesExplicit &&
+		mmap(block, Bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) != MAP_FAILED;
+	gArenaHugeBlocks += huge;
+	if (!huge)
+	{
+		// a failed MAP_FIXED may already have unmapped the reservation here, so map the block afresh rather than just unprotecting it
+		if (mmap(block, Bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+		{
+			throw std::bad_alloc();
+		}
+		if (gHugePages != eHugePagesOff)
+		{
+			madvise(block, Bytes, MADV_HUGEPAGE);
+		}
+	}
+	Local(block, Bytes);
+	gArenaBlocks++;
+	return block;
+}
+
+#else
+
+void* MapBlock(size_t Bytes)
+{
+	void* block = MAP_FAILED;
+	if (gHugePages == eHugePagesExplicit)
+	{
+		block = mmap(nullptr, Bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		gArenaHugeBlocks += block != MAP_FAILED;
+	}
+	if (block == MAP_FAILED && gHugePages != eHugePagesOff)
+	{
+		char* wide = (char*)mmap(nullptr, Bytes + gHugePage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (wide != MAP_FAILED)
+		{
+			char* aligned = (char*)(((uintptr_t)wide + gHugePage - 1) & ~(uintptr_t)(gHugePage - 1));
+			if (aligned > wide)
+			{
+				munmap(wide, aligned - wide);
+			}
+			munmap(aligned + Bytes, wide + gHugePage - aligned);
+			madvise(aligned, Bytes, MADV_HUGEPAGE);
+			block = aligned;
+		}
+	}
+	if (block == MAP_FAILED)
+	{
+		block = mmap(nullptr, Bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	}
+	if (block == MAP_FAILED)
+	{
+		throw std::bad_alloc();
+	}
+	Local(block, Bytes);
+	gArenaBlocks++;
+	return block;
+}
+
+#endif
+
+void* Term::operator new(size_t Bytes)
+{
+	if (Bytes == sizeof(Term) && gArena.mFree != nullptr)
+	{
+		void* t = gArena.mFree;
+		gArena.mFree = *(void**)t;
+		gTermBytes += Bytes;
+		return t;
+	}
+	Bytes = (Bytes + 15) & ~(size_t)15;
+	gTermBytes += Bytes;
+	if (gArena.mNext == nullptr || gArena.mNext + Bytes > gArena.mEnd)
+	{
+		size_t block = std::max(gArenaBlock, Bytes);
+		gArena.mNext = (char*)MapBlock(block);
+		gArena.mEnd = gArena.mNext + block;
+	}
+	void* t = gArena.mNext;
+	gArena.mNext += Bytes;
+	return t;
+}
+
+void Term::operator delete(void* t)
+{
+	gTermBytes -= sizeof(Term);
+	*(void**)t = gArena.mFree;
+	gArena.mFree = t;
+}
+
+#ifdef PROLOGOPS_COMPRESSED_REFS
+void Term::operator delete[](void* t, size_t Bytes)
+{
+	for (size_t at = 0; at + sizeof(Term) <= Bytes; at += sizeof(Term))
+	{
+		operator delete((char*)t + at);
+	}
+}
+#endif
+
+std::atomic<long long> gVariableAge(0);		// shared, as a term made on one thread can be unified on another
+
 Term* mkVar()
 {
 	auto v = new Term();
 	v->mType = eVariable;
 	v->mVariable.mIsBound = false;
 	v->mVariable.mReference = nullptr;
+	v->mVariable.mAge = gVariableAge.fetch_add(1, std::memory_order_relaxed);
+	v->mVariable.mLazy = nullptr;
 	return v;
 }
 
@@ -352,6 +819,31 @@ Term* mkAtom(char* Name, Term* a0, Term* a1)
 	return a;
 }
 
+Term* mkAtom(char* Name, Term* a0, Term* a1, Term* a2)
+{
+	auto a = new Term();
+	a->mType = eAtom;
+	a->mAtom.mName = Name;
+	a->mAtom.mArity = 3;
+	a->mAtom.mTerms[0] = a0;
+	a->mAtom.mTerms[1] = a1;
+	a->mAtom.mTerms[2] = a2;
+	return a;
+}
+
+Term* mkAtom(char* Name, Term* a0, Term* a1, Term* a2, Term* a3)
+{
+	auto a = new Term();
+	a->mType = eAtom;
+	a->mAtom.mName = Name;
+	a->mAtom.mArity = 4;
+	a->mAtom.mTerms[0] = a0;
+	a->mAtom.mTerms[1] = a1;
+	a->mAtom.mTerms[2] = a2;
+	a->mAtom.mTerms[3] = a3;
+	return a;
+}
+
 /* 
 And a more detailed example:
 
@@ -480,26 +972,5958 @@ void Print(Term* Root)
 	}
 }
 
-/* 
-An illustration. This performs:
+/*
+Branch and bound. Enumerating every solution with R() and comparing them afterwards is the obvious way to find the best one, but most of that
+work is wasted - once we know of a solution costing 5, there is no point exploring a branch that has already spent 6. So the query supplies
+an Objective, which evaluates the cost of whatever is bound so far ( unbound parts cost nothing, so this is a lower bound on any completion ), and
+the best known cost - the incumbent - is kept where every branch can see it:
+*/
 
-	member( Item, [ cat, dog, frog ]),
-	member( Item, [ cat, monkey, frog ]).
-	
-This binds Item to list members common to both lists. In this case it prints cat first, followed by from
+typedef std::function<void(Continuation, Retry)>	Goal;
+typedef std::function<int(void)>					Objective;
+
+struct Incumbent
+{
+	std::atomic<int>	mBound;
+
+	Incumbent() : mBound(0x7fffffff) {}
 
+	bool Improve(int Cost)
+	{
+		int best = mBound.load();
+		while (Cost < best)
+		{
+			if (mBound.compare_exchange_weak(best, Cost))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+/*
+The bound is atomic and only ever lowered with a compare and swap, so several searches running on different threads can share one incumbent
+and prune against each other's solutions. Bound() is the pruning goal - dropped into a conjunction, it fails the branch as soon as the
+partial cost reaches the incumbent:
+
+	route( A, B ), bound, leg( B, C ), bound, ...
 */
 
+void Bound(Objective Cost, Incumbent* Best, Continuation K, Retry R)
+{
+	if (Cost() >= Best->mBound.load())
+	{
+		R();
+	}
+	else
+	{
+		K(R);
+	}
+}
+
+/*
+Minimise() runs the query to exhaustion. Each solution that beats the incumbent is handed to K, which is expected to take a copy ( or print it )
+and call R() to keep searching; solutions that don't improve simply backtrack. The last solution passed to K is the optimum.
+*/
 
-int main()
+void Minimise(Goal Query, Objective Cost, Incumbent* Best, Continuation K, Retry R)
 {
-	Term* list =  mkAtom(".", mkAtom("cat"), mkAtom(".", mkAtom("dog"),    mkAtom(".", mkAtom("frog"), mkAtom("[]"))));
-	Term* list2 = mkAtom(".", mkAtom("cat"), mkAtom(".", mkAtom("monkey"), mkAtom(".", mkAtom("frog"), mkAtom("[]"))));
-	Term* item =  mkVar(); 
+	Query([Cost, Best, K](Retry R) {
+		if (Best->Improve(Cost()))
+		{
+			K(R);
+		}
+		else
+		{
+			R();
+		}
+	}, R);
+}
 
-	Member0(item, list, [item, list2](Retry R) {
-		Member0(item, list2, [item](Retry R) { Print(item); R(); }, R); },
-		[]() {});
+/*
+Portfolio search. How long a hard search takes often depends far more on the order clauses are tried in than on the problem itself - one
+ordering finds an answer immediately, another wanders for hours. Rather than guess, we can try several orderings at once. Or() tries a list of
+alternative clauses, in written order normally, but shuffled when the engine has been given a random number generator:
+*/
+
+thread_local std::mt19937*	gRandom = nullptr;
+
+void Alternatives(std::shared_ptr<std::vector<Goal>> Clauses, size_t Next, Continuation K, Retry R)
+{
+	if (Next == Clauses->size())
+	{
+		R();
+		return;
+	}
+
+	int index = gTrail.mTrail.size();
+	auto r = [Clauses, Next, index, K, R]() {
+		gTrail.UnWind(index);
+		Alternatives(Clauses, Next + 1, K, R);
+	};
+
+	(*Clauses)[Next](K, r);
+}
+
+void Or(std::vector<Goal> Clauses, Continuation K, Retry R)
+{
+	if (gRandom != nullptr)
+	{
+		std::shuffle(Clauses.begin(), Clauses.end(), *gRandom);
+	}
+	Alternatives(std::make_shared<std::vector<Goal>>(Clauses), 0, K, R);
+}
+
+/*
+member written this way enumerates the list in a different order for every engine:
+*/
+
+void MemberOr(Term* Item, Term* List, Continuation K, Retry R)
+{
+	Or({ [Item, List](Continuation K, Retry R) {
+			Unify(List, mkAtom(".", Item, mkVar()), K, R); },
+		 [Item, List](Continuation K, Retry R) {
+			Term* T = mkVar();
+			Unify(List, mkAtom(".", mkVar(), T), [Item, T, K](Retry R) { MemberOr(Item, T, K, R); }, R); } },
+		K, R);
+}
+
+/*
+Each shuffled engine also restarts from scratch when it runs out of inferences, with the limit growing according to a schedule - either
+geometric, or the Luby sequence 1 1 2 1 1 2 4 1 1 2 1 1 2 4 8 ... which is within a log factor of the best fixed schedule without knowing
+anything about the problem. A restart with a fresh shuffle gets an engine out of a bad region of the search tree that it would otherwise
+never leave.
+*/
+
+enum Schedule
+{
+	eLuby,
+	eGeometric
+};
+
+long long Luby(int i)
+{
+	int k = 1;
+	while ((1 << k) - 1 < i)
+	{
+		k++;
+	}
+	if (i == (1 << k) - 1)
+	{
+		return 1LL << (k - 1);
+	}
+	return Luby(i - (1 << (k - 1)) + 1);
+}
+
+long long RestartLimit(Schedule Restarts, long long Base, int Attempt)
+{
+	return Restarts == eLuby ? Base * Luby(Attempt + 1) : Base << (Attempt < 40 ? Attempt : 40);
+}
+
+/*
+Portfolio() runs Engines copies of the query, one per thread. The engines must not share variables, so each one gets its own Answer variable
+for the query to bind, and Query has to build any others it needs with mkVar() each time it is called - ground terms like the lists in main()
+are only read, and can be shared freely. The first engine to find a solution claims it, hands the bound Answer to Result, and cancels the
+others; an engine that exhausts the search without hitting its limit has proved there is no solution and cancels everyone too. Engine 0
+searches in the written order, with no shuffle, and so is never restarted - it would only go down the same path again, a little further
+each time. It runs once, without a limit, as the complete search alongside the shuffled ones, and is the one that proves there is no
+solution when none of them find one.
+*/
+
+typedef std::function<void(Term*, Continuation, Retry)>	Query;
+
+bool Portfolio(Query Q, int Engines, Schedule Restarts, long long Base, std::function<void(Term*)> Result)
+{
+	std::atomic<bool> cancel(false);
+	std::atomic<bool> found(false);
+	std::vector<std::thread> threads;
+
+	for (int e = 0; e < Engines; e++)
+	{
+		threads.emplace_back([&, e]() {
+			std::mt19937 random(e);
+			gRandom = e == 0 ? nullptr : &random;
+			gCancel = &cancel;
+
+			for (int attempt = 0; !cancel.load(); attempt++)
+			{
+				bool exhausted = false;
+				Term* answer = mkVar();
+				gInferences = 0;
+				gInferenceLimit = e == 0 ? LLONG_MAX : RestartLimit(Restarts, Base, attempt);
+
+				Q(answer, [&](Retry) {
+					if (!found.exchange(true))
+					{
+						cancel.store(true);
+						Result(answer);
+					}
+				}, [&]() { exhausted = true; });
+
+				gTrail.UnWind(0);
+				if (exhausted)
+				{
+					cancel.store(true);
+				}
+			}
+
+			gRandom = nullptr;
+			gCancel = nullptr;
+			gInferenceLimit = LLONG_MAX;
+		});
+	}
+
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	return found.load();
+}
+
+/*
+A program as data. Member0 and Member1 are compiled by hand, but the same scheme works for any predicate if its clauses are kept as terms and
+interpreted - each clause is renamed apart ( given fresh variables ), its head unified with the goal, and its body solved left to right:
+
+	capital( france, paris ).
+	capital( spain, madrid ).
+	
+Look at the Member0 scheme again, though - a clause always leaves a retry to the next one, even when the next one can't possibly match. Call
+capital( spain, C ) and a choice point is left behind for italy, which is only discovered to be useless on backtracking. So when clauses are
+loaded we analyse them. Two clauses are exclusive on an argument if, once that argument is bound, at most one of them can match - their heads
+have different functors there, or one of them starts with a var/nonvar test that rules it out. A predicate whose clauses are pairwise exclusive
+on some argument is deterministic whenever that argument is bound, and is called without a choice point at all.
+*/
+
+enum Mode
+{
+	eModeUnknown,
+	eModeGround,
+	eModeFree,
+	eModeAny
+};
+
+enum OpKind
+{
+	eAlias,
+	eMatch,
+	eBuild,
+	eUnifyArg
+};
+
+struct Op
+{
+	OpKind			mKind;
+	Term*			mHead;
+	std::vector<Op>	mArgs;
+};
+
+struct Profile
+{
+	std::atomic<long long>	mTries;
+	std::atomic<long long>	mSuccesses;
+
+	Profile() : mTries(0), mSuccesses(0) {}
+};
+
+struct Clause
+{
+	Term*						mHead;
+	std::vector<Term*>			mBody;
+	int							mGuard;			// head argument tested by a leading var() or nonvar(), or -1
+	bool						mGuardBound;	// true for nonvar()
+	std::vector<Op>				mOps;			// head matching code, see Compile()
+	std::shared_ptr<Profile>	mProfile;		// see DeclareUnordered()
+	Term*						mSourceHead;	// the clause as written, once Unfold() has rewritten it
+	std::vector<Term*>			mSourceBody;
+};
+
+typedef std::shared_ptr<const std::vector<size_t>>	Order;
+
+struct Memo;
+struct Shards;
+struct External;
+
+struct Predicate
+{
+	std::vector<Clause>	mClauses;
+	int					mKey;			// an argument the clauses are pairwise exclusive on, or -1
+	std::vector<Mode>	mModes;			// how each argument is instantiated at every known call
+	bool				mFacts;			// every clause is a fact, see Collect()
+	std::vector<int>	mDistinct;		// distinct values in each argument of the facts
+	std::vector<bool>	mGround;		// whether each argument is ground in every fact
+	bool				mStatsStale;
+	Order				mOrder;			// the order clauses are tried in when profiled, or nullptr for written order
+	std::shared_ptr<Profile>	mCalls;
+	bool				mTabled;
+	bool				mInlined;		// unfolded into another predicate's clauses, see Unfold()
+	std::shared_ptr<Memo>	mMemo;			// see DeclareMemo()
+	std::shared_ptr<Shards>	mShards;		// see DeclareSharded()
+	std::shared_ptr<External>	mExternal;	// see DeclareExternal()
+
+	Predicate() : mKey(-1), mFacts(false), mStatsStale(true), mTabled(false), mInlined(false) {}
+};
+
+std::map<std::string, Predicate>	gProgram;
+bool								gModesStale = true;
+thread_local long long				gChoicePoints = 0;
+thread_local long long				gDeterministicCalls = 0;
+thread_local long long				gClosures = 0;
+
+std::string Functor(Term* t)
+{
+	return std::string(t->mAtom.mName) + "/" + std::to_string(t->mAtom.mArity);
+}
+
+bool SameFunctor(Term* t0, Term* t1)
+{
+	return strcmp(t0->mAtom.mName, t1->mAtom.mName) == 0 && t0->mAtom.mArity == t1->mAtom.mArity;
+}
+
+bool Exclusive(Clause& c0, Clause& c1, int Arg)
+{
+	Term* h0 = c0.mHead->mAtom.mTerms[Arg];
+	Term* h1 = c1.mHead->mAtom.mTerms[Arg];
+
+	if ((c0.mGuard == Arg && !c0.mGuardBound) || (c1.mGuard == Arg && !c1.mGuardBound))
+	{
+		return true;
+	}
+	return h0->mType == eAtom && h1->mType == eAtom && !SameFunctor(h0, h1);
+}
+
+void Analyse(Predicate& P)
+{
+	P.mKey = -1;
+	int arity = P.mClauses[0].mHead->mAtom.mArity;
+	for (int arg = 0; arg < arity && P.mKey < 0; arg++)
+	{
+		bool exclusive = true;
+		for (size_t i = 0; i < P.mClauses.size() && exclusive; i++)
+		{
+			for (size_t j = i + 1; j < P.mClauses.size() && exclusive; j++)
+			{
+				exclusive = Exclusive(P.mClauses[i], P.mClauses[j], arg);
+			}
+		}
+		if (exclusive)
+		{
+			P.mKey = arg;
+		}
+	}
+}
+
+/*
+Clauses are added with AddClause() ( usually through Assert(), further down ), which keeps the analysis up to date. Adding a clause can only
+take exclusivity away, so a predicate without a key never gains one, and one with a key only needs the new clause checked against the rest -
+the full analysis is only re-run when that check fails. A new fact doesn't change how anything is called either, so it is compiled on its own
+rather than marking the modes stale.
+*/
+
+void FindGuard(Clause& C)
+{
+	C.mGuard = -1;
+	if (C.mBody.empty() || C.mBody[0]->mAtom.mArity != 1 ||
+		(strcmp(C.mBody[0]->mAtom.mName, "var") != 0 && strcmp(C.mBody[0]->mAtom.mName, "nonvar") != 0))
+	{
+		return;
+	}
+
+	for (int i = 0; i < C.mHead->mAtom.mArity; i++)
+	{
+		if (C.mHead->mAtom.mTerms[i] == C.mBody[0]->mAtom.mTerms[0] && C.mHead->mAtom.mTerms[i]->mType == eVariable)
+		{
+			C.mGuard = i;
+			C.mGuardBound = strcmp(C.mBody[0]->mAtom.mName, "nonvar") == 0;
+			break;
+		}
+	}
+}
+
+void CompileClause(Predicate& P, Clause& C);
+void Invalidate(const std::string& Functor);
+void Refold();
+
+void AddClause(Term* Head, std::vector<Term*> Body)
+{
+	Invalidate(Functor(Head));
+	Clause c = { Head, Body, -1, false, {}, std::make_shared<Profile>(), nullptr, {} };
+	FindGuard(c);
+
+	Predicate& p = gProgram[Functor(Head)];
+	p.mClauses.push_back(c);
+	if (p.mOrder != nullptr)
+	{
+		auto order = std::make_shared<std::vector<size_t>>(*p.mOrder);
+		order->push_back(p.mClauses.size() - 1);
+		std::atomic_store(&p.mOrder, Order(order));
+	}
+	p.mModes.resize(Head->mAtom.mArity, eModeUnknown);
+	p.mStatsStale = true;
+
+	bool keyed = p.mClauses.size() == 1;
+	if (p.mKey >= 0)
+	{
+		keyed = true;
+		for (size_t i = 0; i + 1 < p.mClauses.size() && keyed; i++)
+		{
+			keyed = Exclusive(p.mClauses[i], p.mClauses.back(), p.mKey);
+		}
+	}
+	if (!keyed && (p.mKey >= 0 || p.mClauses.size() == 2))
+	{
+		Analyse(p);
+	}
+	else if (!keyed)
+	{
+		p.mKey = -1;
+	}
+
+	if (!Body.empty())
+	{
+		gModesStale = true;
+	}
+	else if (!gModesStale)
+	{
+		CompileClause(p, p.mClauses.back());
+	}
+
+	if (p.mInlined)
+	{
+		Refold();
+	}
+}
+
+/*
+Having one candidate clause only makes a call deterministic if that clause's body is as well. ReportDeterminism() starts from every predicate
+with a single clause or a key and strikes out any with a body goal that could leave a choice point, until nothing changes - a goal to a
+keyed predicate counts against it, as nothing here knows whether the key will be bound. A predicate that only calls itself stays in.
+*/
+
+bool DeterministicBuiltin(Term* Goal)
+{
+	const char* name = Goal->mAtom.mName;
+	return strcmp(name, "true") == 0 || strcmp(name, "fail") == 0 || strcmp(name, "!") == 0 || strcmp(name, "=") == 0 ||
+		strcmp(name, "var") == 0 || strcmp(name, "nonvar") == 0;
+}
+
+void ReportDeterminism()
+{
+	std::set<std::string> deterministic;
+	for (auto& p : gProgram)
+	{
+		if (p.second.mClauses.size() == 1 || p.second.mKey >= 0)
+		{
+			deterministic.insert(p.first);
+		}
+	}
+
+	for (bool changed = true; changed;)
+	{
+		changed = false;
+		for (auto it = deterministic.begin(); it != deterministic.end();)
+		{
+			bool keep = true;
+			for (Clause& c : gProgram[*it].mClauses)
+			{
+				for (Term* g : c.mBody)
+				{
+					Term* goal = Deref(g);
+					std::string name = Functor(goal);
+					keep = keep && (DeterministicBuiltin(goal) || (deterministic.count(name) > 0 && gProgram[name].mClauses.size() == 1));
+				}
+			}
+			if (keep)
+			{
+				++it;
+			}
+			else
+			{
+				it = deterministic.erase(it);
+				changed = true;
+			}
+		}
+	}
+
+	for (const std::string& name : deterministic)
+	{
+		Predicate& p = gProgram[name];
+		if (p.mClauses.size() == 1)
+		{
+			printf("%s is deterministic\n", name.c_str());
+		}
+		else
+		{
+			printf("%s is deterministic when argument %d is bound\n", name.c_str(), p.mKey + 1);
+		}
+	}
+}
+
+/*
+At run time, Candidate() is the cheap check that a clause could match the call at all - no clashing functors against the bound arguments, and
+its type test passes. A retry is only built if another candidate clause exists after the one being tried; for a predicate with a key, a bound
+key argument means there is none, so we don't even look.
+*/
+
+bool Candidate(Clause& C, Term* Goal)
+{
+	for (int i = 0; i < Goal->mAtom.mArity; i++)
+	{
+		Term* a = Deref(Goal->mAtom.mTerms[i]);
+		Term* h = C.mHead->mAtom.mTerms[i];
+		if (a->mType == eAtom && h->mType == eAtom && !SameFunctor(a, h))
+		{
+			return false;
+		}
+	}
+	return C.mGuard < 0 || (Deref(Goal->mAtom.mTerms[C.mGuard])->mType == eAtom) == C.mGuardBound;
+}
+
+Term* Own(Term* t)
+{
+	Term* a = new Term(*t);
+	a->mAtom.mName = strdup(t->mAtom.mName);
+	a->mAtom.mBorrowed = false;
+	return a;
+}
+
+Term* Rename(Term* t, std::map<Term*, Term*>& Fresh)
+{
+	t = Deref(t);
+	if (t->mType == eVariable)
+	{
+		auto it = Fresh.find(t);
+		if (it == Fresh.end())
+		{
+			it = Fresh.emplace(t, mkVar()).first;
+		}
+		return it->second;
+	}
+	if (t->mAtom.mArity == 0)
+	{
+		return t->mAtom.mBorrowed ? Own(t) : t;
+	}
+
+	Term* a = new Term(*t);
+	for (int i = 0; i < t->mAtom.mArity; i++)
+	{
+		a->mAtom.mTerms[i] = Rename(t->mAtom.mTerms[i], Fresh);
+	}
+	return a;
+}
+
+/*
+Modes. Unify() works out what to do from the types of both sides on every call, but at most call sites the answer is always the same - member
+is nearly always called with a bound list, so matching its head [H|T] only ever needs to check the functor and pick the list apart. A mode
+declaration says how a predicate is called from outside:
+
+	:- mode member( ?, + ).
+
++ is ground, - is free and ? is anything. From the declared entry points Infer() works through the clause bodies to find how every predicate
+is called from inside the program as well, until nothing changes. A variable is ground if it appears in a ground head argument, free until
+first passed to a goal, and anything after that.
+*/
+
+Mode Join(Mode m0, Mode m1)
+{
+	if (m0 == m1 || m1 == eModeUnknown)
+	{
+		return m0;
+	}
+	return m0 == eModeUnknown ? m1 : eModeAny;
+}
+
+void Variables(Term* t, std::vector<Term*>& Vars)
+{
+	if (t->mType == eVariable)
+	{
+		Vars.push_back(t);
+	}
+	else
+	{
+		for (int i = 0; i < t->mAtom.mArity; i++)
+		{
+			Variables(t->mAtom.mTerms[i], Vars);
+		}
+	}
+}
+
+Mode ModeOf(Term* t, std::map<Term*, Mode>& State)
+{
+	if (t->mType == eVariable)
+	{
+		auto it = State.find(t);
+		return it == State.end() ? eModeFree : it->second;
+	}
+
+	std::vector<Term*> vars;
+	Variables(t, vars);
+	for (Term* v : vars)
+	{
+		if (ModeOf(v, State) != eModeGround)
+		{
+			return eModeAny;
+		}
+	}
+	return eModeGround;
+}
+
+bool InferClause(Predicate& P, Clause& C)
+{
+	std::map<Term*, Mode> state;
+	for (int i = 0; i < C.mHead->mAtom.mArity; i++)
+	{
+		Term* arg = C.mHead->mAtom.mTerms[i];
+		std::vector<Term*> vars;
+		Variables(arg, vars);
+		for (Term* v : vars)
+		{
+			Mode m = P.mModes[i] == eModeGround ? eModeGround : (arg->mType == eVariable ? P.mModes[i] : eModeFree);
+			auto it = state.find(v);
+			state[v] = it == state.end() || m == eModeGround ? m : (it->second == eModeGround ? eModeGround : eModeAny);
+		}
+	}
+
+	bool changed = false;
+	for (Term* g : C.mBody)
+	{
+		auto it = gProgram.find(Functor(g));
+		if (it != gProgram.end())
+		{
+			for (int i = 0; i < g->mAtom.mArity; i++)
+			{
+				Mode m = Join(it->second.mModes[i], ModeOf(g->mAtom.mTerms[i], state));
+				changed |= m != it->second.mModes[i];
+				it->second.mModes[i] = m;
+			}
+		}
+
+		std::vector<Term*> vars;
+		Variables(g, vars);
+		for (Term* v : vars)
+		{
+			if (ModeOf(v, state) != eModeGround)
+			{
+				state[v] = eModeAny;
+			}
+		}
+	}
+	return changed;
+}
+
+/*
+Once the modes are known each clause head is compiled into a tree of Ops, one per argument:
+
+	eAlias		first occurrence of a head variable - no new variable, no binding, it just names the caller's argument
+	eMatch		a ground argument against a structure - compare the functor, then match the arguments
+	eBuild		a free argument against a structure - bind the caller's variable to a copy of it
+	eUnifyArg	anything else, handed to the general Unify()
+
+For member( ?, + ) the first clause member( H, [H|_] ) becomes alias, match ./2, unify, alias - no terms built at all. eMatch and eBuild
+still check the caller's argument really is bound or free, as a query that breaks its declared mode falls back to Unify() rather than failing.
+*/
+
+Op CompileArg(Term* Head, Mode M, std::map<Term*, bool>& Seen)
+{
+	Op op = { eUnifyArg, Head, {} };
+	if (Head->mType == eVariable)
+	{
+		if (!Seen[Head])
+		{
+			op.mKind = eAlias;
+		}
+		Seen[Head] = true;
+	}
+	else if (M == eModeGround)
+	{
+		op.mKind = eMatch;
+		for (int i = 0; i < Head->mAtom.mArity; i++)
+		{
+			op.mArgs.push_back(CompileArg(Head->mAtom.mTerms[i], eModeGround, Seen));
+		}
+	}
+	else
+	{
+		op.mKind = M == eModeFree ? eBuild : eUnifyArg;
+		std::vector<Term*> vars;
+		Variables(Head, vars);
+		for (Term* v : vars)
+		{
+			Seen[v] = true;
+		}
+	}
+	return op;
+}
+
+void CompileClause(Predicate& P, Clause& C)
+{
+	std::map<Term*, bool> seen;
+	C.mOps.clear();
+	for (int i = 0; i < C.mHead->mAtom.mArity; i++)
+	{
+		C.mOps.push_back(CompileArg(C.mHead->mAtom.mTerms[i], P.mModes[i], seen));
+	}
+}
+
+void Compile(Predicate& P)
+{
+	for (Clause& c : P.mClauses)
+	{
+		CompileClause(P, c);
+	}
+}
+
+void Infer()
+{
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (auto& p : gProgram)
+		{
+			for (Clause& c : p.second.mClauses)
+			{
+				changed |= InferClause(p.second, c);
+			}
+		}
+	}
+
+	for (auto& p : gProgram)
+	{
+		Compile(p.second);
+	}
+	gModesStale = false;
+}
+
+void DeclareMode(Term* Pattern)
+{
+	Predicate& p = gProgram[Functor(Pattern)];
+	p.mModes.resize(Pattern->mAtom.mArity, eModeUnknown);
+	for (int i = 0; i < Pattern->mAtom.mArity; i++)
+	{
+		char c = Pattern->mAtom.mTerms[i]->mAtom.mName[0];
+		p.mModes[i] = Join(p.mModes[i], c == '+' ? eModeGround : c == '-' ? eModeFree : eModeAny);
+	}
+	gModesStale = true;
+}
+
+void ReportModes()
+{
+	if (gModesStale)
+	{
+		Infer();
+	}
+	for (auto& p : gProgram)
+	{
+		printf("%s called as (", p.first.c_str());
+		for (Mode m : p.second.mModes)
+		{
+			printf(" %c", "_+-?"[m]);
+		}
+		printf(" )\n");
+	}
+}
+
+/*
+Execute() runs the compiled head against the caller's arguments. Anything it can't settle directly is collected and unified afterwards.
+*/
+
+typedef std::shared_ptr<std::vector<std::pair<Term*, Term*>>>	Pairs;
+
+bool Execute(std::vector<Op>& Ops, Ref* Args, std::map<Term*, Term*>& Fresh, Pairs Deferred)
+{
+	for (size_t i = 0; i < Ops.size(); i++)
+	{
+		Op& op = Ops[i];
+		Term* a = Deref(Args[i]);
+		if (op.mKind == eAlias)
+		{
+			Fresh[op.mHead] = a;
+		}
+		else if (op.mKind == eMatch && a->mType == eAtom)
+		{
+			if (!SameFunctor(a, op.mHead) || !Execute(op.mArgs, a->mAtom.mTerms, Fresh, Deferred))
+			{
+				return false;
+			}
+		}
+		else if (op.mKind == eBuild && a->mType == eVariable && a->mVariable.mLazy == nullptr)
+		{
+			Bind(a, Rename(op.mHead, Fresh));
+		}
+		else
+		{
+			Deferred->push_back({ a, Rename(op.mHead, Fresh) });
+		}
+	}
+	return true;
+}
+
+void UnifyAll(Pairs All, size_t Next, Continuation K, Retry R)
+{
+	if (Next == All->size())
+	{
+		K(R);
+		return;
+	}
+
+	Unify((*All)[Next].first, (*All)[Next].second, [All, Next, K](Retry R) {
+		UnifyAll(All, Next + 1, K, R);
+	}, R);
+}
+
+/*
+The body is solved a goal at a time. Cut needs one more piece of state - the retry that was passed in when the predicate was called. Executing
+'!' continues with that retry instead of the current one, which discards every choice point made since the call. The last goal of a body, and
+a clause with no body at all, are given the caller's continuation directly - wrapping it in a closure that only calls it on, like the k in
+Member0, costs an allocation and a stack frame for nothing. gClosures counts the ones that are made.
+*/
+
+typedef std::shared_ptr<std::vector<Term*>>	Body;
+
+void Call(Term* Goal, Continuation K, Retry R, Retry Cut);
+
+void SolveBody(Body Goals, size_t Next, Continuation K, Retry R, Retry Cut)
+{
+	if (Next + 1 == Goals->size())
+	{
+		Call((*Goals)[Next], K, R, Cut);
+		return;
+	}
+
+	gClosures++;
+	Call((*Goals)[Next], [Goals, Next, K, Cut](Retry R) {
+		SolveBody(Goals, Next + 1, K, R, Cut);
+	}, R, Cut);
+}
+
+Clause& At(Predicate* P, Order O, size_t i)
+{
+	return P->mClauses[O == nullptr ? i : (*O)[i]];
+}
+
+void Try(Predicate* P, Order O, Term* Goal, size_t Next, Continuation K, Retry R)
+{
+	if (Halted())
+	{
+		return;
+	}
+
+	size_t count = O == nullptr ? P->mClauses.size() : O->size();
+	size_t i = Next;
+	while (i < count && !Candidate(At(P, O, i), Goal))
+	{
+		i++;
+	}
+	if (i == count)
+	{
+		R();
+		return;
+	}
+
+	size_t j = count;
+	if (P->mKey < 0 || Deref(Goal->mAtom.mTerms[P->mKey])->mType == eVariable)
+	{
+		for (j = i + 1; j < count && !Candidate(At(P, O, j), Goal); j++)
+		{
+		}
+	}
+
+	Retry r = R;
+	if (j < count)
+	{
+		Clause& first = At(P, O, i);
+		for (size_t a = 0; a < first.mOps.size(); a++)
+		{
+			Term* t = Deref(Goal->mAtom.mTerms[a]);
+			if (first.mOps[a].mKind != eAlias && t->mType == eVariable && t->mVariable.mLazy != nullptr)
+			{
+				Force(t);		// before the choice point, or every clause would read it again, see Force()
+			}
+		}
+		gChoicePoints++;
+		gClosures++;
+		int index = gTrail.mTrail.size();
+		r = [P, O, Goal, j, K, R, index]() {
+			gTrail.UnWind(index);
+			Try(P, O, Goal, j, K, R);
+		};
+	}
+	else
+	{
+		gDeterministicCalls++;
+	}
+
+	std::map<Term*, Term*> fresh;
+	Clause& c = At(P, O, i);
+	Continuation k = K;
+	if (O != nullptr)
+	{
+		Profile* profile = c.mProfile.get();
+		profile->mTries++;
+		auto succeeded = std::make_shared<bool>(false);
+		k = [profile, succeeded, K](Retry R) {
+			if (!*succeeded)
+			{
+				*succeeded = true;
+				profile->mSuccesses++;
+			}
+			K(R);
+		};
+	}
+
+	Pairs deferred = std::make_shared<std::vector<std::pair<Term*, Term*>>>();
+	if (!Execute(c.mOps, Goal->mAtom.mTerms, fresh, deferred))
+	{
+		r();
+		return;
+	}
+
+	Body body = std::make_shared<std::vector<Term*>>();
+	for (Term* g : c.mBody)
+	{
+		body->push_back(Rename(g, fresh));
+	}
+
+	if (body->empty())
+	{
+		UnifyAll(deferred, 0, k, r);
+	}
+	else
+	{
+		gClosures++;
+		UnifyAll(deferred, 0, [body, k, R](Retry r) { SolveBody(body, 0, k, r, R); }, r);
+	}
+}
+
+/*
+Clause order. For some predicates the order of the clauses is only an accident of how they were written - any order gives the same answers
+in a different sequence. When the clause that usually succeeds comes last, every call pays for the ones before it to fail first. Declaring
+such a predicate unordered turns on profiling: each clause counts how often it is tried and how many of those tries get as far as its
+continuation - once per try, however many answers the body goes on to give, so successes never outrun tries - and every gReorderInterval calls the clauses are re-sorted so the most successful are tried first. The order is a shared, immutable vector
+that a call takes a copy of the pointer to when it starts, so a re-sort never disturbs a search that is already running - even one on another
+thread. SaveProfile() and LoadProfile() carry the counts from one run to the next, so the order doesn't have to be learnt again. A clause's
+counts are saved under the clause itself, written out as a variant, rather than its position - the program a profile is loaded into may
+have gained, lost or moved clauses since, and a count that landed on whichever clause is now in the same place would order it wrongly.
+Counts for a clause that has gone are dropped, and a new clause starts from nothing.
+*/
+
+int gReorderInterval = 256;
+
+void Reprioritise(Predicate* P)
+{
+	auto order = std::make_shared<std::vector<size_t>>();
+	for (size_t i = 0; i < P->mClauses.size(); i++)
+	{
+		order->push_back(i);
+	}
+
+	auto rate = [P](size_t i) {
+		Profile* profile = P->mClauses[i].mProfile.get();
+		return (profile->mSuccesses.load() + 1.0) / (profile->mTries.load() + 2.0);
+	};
+	std::stable_sort(order->begin(), order->end(), [rate](size_t a, size_t b) { return rate(a) > rate(b); });
+	std::atomic_store(&P->mOrder, Order(order));
+}
+
+void DeclareUnordered(const char* Name)
+{
+	Predicate& p = gProgram[Name];
+	p.mCalls = std::make_shared<Profile>();
+	Reprioritise(&p);
+}
+
+void Resolve(Predicate* P, Term* Goal, Continuation K, Retry R)
+{
+	if (P->mCalls != nullptr && ++P->mCalls->mTries % gReorderInterval == 0)
+	{
+		Reprioritise(P);
+	}
+	Try(P, std::atomic_load(&P->mOrder), Goal, 0, K, R);
+}
+
+std::string Variant(Term* t, std::map<Term*, int>& Vars);
+
+std::string Signature(Clause& C)
+{
+	bool rewritten = C.mSourceHead != nullptr;		// by Unfold(), and saved the way it was written
+	std::map<Term*, int> vars;
+	std::string key = Variant(rewritten ? C.mSourceHead : C.mHead, vars);
+	for (Term* g : rewritten ? C.mSourceBody : C.mBody)
+	{
+		key += " " + Variant(g, vars);
+	}
+	return key;
+}
+
+void SaveProfile(const char* File)
+{
+	std::ofstream out(File);
+	for (auto& p : gProgram)
+	{
+		if (p.second.mCalls == nullptr)
+		{
+			continue;
+		}
+		for (Clause& c : p.second.mClauses)
+		{
+			Profile* profile = c.mProfile.get();
+			out << p.first << " " << profile->mTries.load() << " " << profile->mSuccesses.load() << " " << Signature(c) << "\n";
+		}
+	}
+}
+
+void LoadProfile(const char* File)
+{
+	std::ifstream in(File);
+	std::string name;
+	long long tries;
+	long long successes;
+	std::string clause;
+	std::set<Profile*> loaded;		// a clause written twice takes one line each
+	while (in >> name >> tries >> successes && std::getline(in >> std::ws, clause))
+	{
+		auto it = gProgram.find(name);
+		if (it == gProgram.end() || it->second.mCalls == nullptr)
+		{
+			continue;
+		}
+		for (Clause& c : it->second.mClauses)
+		{
+			Profile* profile = c.mProfile.get();
+			if (loaded.count(profile) == 0 && Signature(c) == clause)
+			{
+				profile->mTries += tries;
+				profile->mSuccesses += successes;
+				loaded.insert(profile);
+				break;
+			}
+		}
+	}
+
+	for (auto& p : gProgram)
+	{
+		if (p.second.mCalls != nullptr)
+		{
+			Reprioritise(&p.second);
+		}
+	}
+}
+
+/*
+Call() handles the few built-ins we need, and otherwise looks the predicate up. Solve() is the entry point for a query - a deterministic call
+passes its caller's retry straight through, so the query's own retry is the one that has to undo its bindings.
+*/
+
+void Read(const std::string& Functor);
+void TabledCall(Predicate* P, Term* Goal, Continuation K, Retry R);
+void MemoCall(Predicate* P, Term* Goal, Continuation K, Retry R);
+void ShardedCall(Predicate* P, Term* Goal, Continuation K, Retry R);
+void ExternalCall(Predicate* P, Term* Goal, Continuation K, Retry R);
+void ReadBytes(Term* Goal, Continuation K, Retry R);
+void FileLines(Term* Goal, Continuation K, Retry R);
+void FileLine(Term* Goal, Continuation K, Retry R);
+void Invoke(const std::string& Functor, Predicate* P, Term* Goal, Continuation K, Retry R);
+
+void Call(Term* Goal, Continuation K, Retry R, Retry Cut)
+{
+	Term* g = Deref(Goal);
+	char* name = g->mAtom.mName;
+
+	if (strcmp(name, "!") == 0)
+	{
+		K(Cut);
+	}
+	else if (strcmp(name, "true") == 0)
+	{
+		K(R);
+	}
+	else if (strcmp(name, "fail") == 0)
+	{
+		R();
+	}
+	else if (strcmp(name, "=") == 0 && g->mAtom.mArity == 2)
+	{
+		Unify(g->mAtom.mTerms[0], g->mAtom.mTerms[1], K, R);
+	}
+	else if (strcmp(name, "read_bytes") == 0 && g->mAtom.mArity == 4)
+	{
+		ReadBytes(g, K, R);
+	}
+	else if (strcmp(name, "file_lines") == 0 && g->mAtom.mArity == 2)
+	{
+		FileLines(g, K, R);
+	}
+	else if (strcmp(name, "file_line") == 0 && g->mAtom.mArity == 2)
+	{
+		FileLine(g, K, R);
+	}
+	else if ((strcmp(name, "var") == 0 || strcmp(name, "nonvar") == 0) && g->mAtom.mArity == 1)
+	{
+		Term* t = Deref(g->mAtom.mTerms[0]);
+		bool bound = t->mType == eAtom || t->mVariable.mLazy != nullptr;
+		if (bound == (name[0] == 'n'))
+		{
+			K(R);
+		}
+		else
+		{
+			R();
+		}
+	}
+	else
+	{
+		if (gModesStale)
+		{
+			Infer();
+		}
+
+		std::string functor = Functor(g);
+		auto it = gProgram.find(functor);
+		Invoke(functor, it == gProgram.end() ? nullptr : &it->second, g, K, R);
+	}
+}
+
+/*
+Invoke() calls a predicate that has already been looked up, choosing how by what has been declared about it. Call() comes here for anything
+that isn't a built-in, and so does a Prepared query, which looks its predicates up once - either way a tabled, memoised, sharded or external
+predicate is called as such, and the read is recorded for whatever table is being evaluated.
+*/
+
+void Invoke(const std::string& Functor, Predicate* P, Term* Goal, Continuation K, Retry R)
+{
+	Read(Functor);
+	if (P != nullptr && P->mShards != nullptr)
+	{
+		ShardedCall(P, Goal, K, R);
+	}
+	else if (P != nullptr && P->mExternal != nullptr)
+	{
+		ExternalCall(P, Goal, K, R);
+	}
+	else if (P == nullptr || P->mClauses.empty())
+	{
+		R();
+	}
+	else if (P->mTabled)
+	{
+		TabledCall(P, Goal, K, R);
+	}
+	else if (P->mMemo != nullptr)
+	{
+		MemoCall(P, Goal, K, R);
+	}
+	else
+	{
+		Resolve(P, Goal, K, R);
+	}
+}
+
+void Solve(Term* Goal, Continuation K, Retry R)
+{
+	int index = gTrail.mTrail.size();
+	auto r = [index, R]() {
+		gTrail.UnWind(index);
+		R();
+	};
+
+	Call(Goal, K, r, r);
+}
+
+/*
+Partial evaluation. Rule bases grow small wrapper predicates - a rule that just calls another with an argument filled in, and so on down to
+the facts:
+
+	spanish_capital( C ) :- capital( spain, C ).
+	greeting( C ) :- spanish_capital( C ).
+
+Every call through such a chain costs a lookup, a renaming and a couple of continuations, to arrive at an answer that could have been worked
+out when the rules were loaded. Unfold() does that work ahead of time. A body goal is replaced by the body of the clause it calls when only
+one clause could match it ( so the call is deterministic, which is what makes a call with constant arguments to a set of facts unfoldable ),
+the predicate it calls is not recursive, and that clause has no cut ( whose scope unfolding would change ). The head is unified with the goal
+there and then, so the bindings are built into the new clause:
+
+	spanish_capital( madrid ).
+	greeting( madrid ).
+
+Unfold() is run once, after loading - the original predicates are kept, as queries may still call them. A rewritten clause remembers how it
+was written, though, because an unfolded body is only right while the clauses it was taken from stay as they are: if a predicate that was
+unfolded into others is later asserted to or retracted from, Refold() puts every clause back as written and unfolds the program again.
+
+A callee clause guarded by var() or nonvar() only counts as ruled in or out once the guard's argument is bound at the call. If it is a
+variable there, it may well be bound by the time the clause runs, so that goal is left alone.
+*/
+
+bool Calls(Predicate* From, Predicate* To, std::map<Predicate*, bool>& Visited)
+{
+	if (Visited[From])
+	{
+		return false;
+	}
+	Visited[From] = true;
+
+	for (Clause& c : From->mClauses)
+	{
+		for (Term* g : c.mBody)
+		{
+			auto it = gProgram.find(Functor(g));
+			if (it != gProgram.end() && (&it->second == To || Calls(&it->second, To, Visited)))
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+bool Unfoldable(Predicate* P)
+{
+	std::map<Predicate*, bool> visited;
+	for (Clause& c : P->mClauses)
+	{
+		for (Term* g : c.mBody)
+		{
+			if (strcmp(g->mAtom.mName, "!") == 0)
+			{
+				return false;
+			}
+		}
+	}
+	return !P->mClauses.empty() && !Calls(P, P, visited);
+}
+
+void Keep(Clause& C)
+{
+	if (C.mSourceHead == nullptr)
+	{
+		C.mSourceHead = C.mHead;
+		C.mSourceBody = C.mBody;
+	}
+}
+
+bool UnfoldClause(Clause& C)
+{
+	for (size_t i = 0; i < C.mBody.size(); i++)
+	{
+		Term* g = C.mBody[i];
+		if (strcmp(g->mAtom.mName, "true") == 0 && g->mAtom.mArity == 0)
+		{
+			Keep(C);
+			C.mBody.erase(C.mBody.begin() + i);
+			return true;
+		}
+
+		auto it = gProgram.find(Functor(g));
+		if (it == gProgram.end() || !Unfoldable(&it->second))
+		{
+			continue;
+		}
+
+		bool fixed = true;
+		for (Clause& c : it->second.mClauses)
+		{
+			fixed = fixed && (c.mGuard < 0 || Deref(g->mAtom.mTerms[c.mGuard])->mType == eAtom);
+		}
+		if (!fixed)
+		{
+			continue;
+		}
+
+		Clause* only = nullptr;
+		int candidates = 0;
+		for (Clause& c : it->second.mClauses)
+		{
+			if (Candidate(c, g))
+			{
+				only = &c;
+				candidates++;
+			}
+		}
+		if (candidates != 1)
+		{
+			continue;
+		}
+
+		std::map<Term*, Term*> fresh;
+		Term* head = Rename(only->mHead, fresh);
+		std::vector<Term*> body;
+		for (Term* b : only->mBody)
+		{
+			body.push_back(Rename(b, fresh));
+		}
+
+		int index = gTrail.mTrail.size();
+		bool unified = false;
+		Unify(g, head, [&unified](Retry) { unified = true; }, []() {});
+		if (!unified)
+		{
+			gTrail.UnWind(index);
+			continue;
+		}
+
+		std::vector<Term*> goals(C.mBody.begin(), C.mBody.begin() + i);
+		goals.insert(goals.end(), body.begin(), body.end());
+		goals.insert(goals.end(), C.mBody.begin() + i + 1, C.mBody.end());
+
+		Keep(C);
+		it->second.mInlined = true;
+		std::map<Term*, Term*> renamed;
+		C.mHead = Rename(C.mHead, renamed);
+		C.mBody.clear();
+		for (Term* b : goals)
+		{
+			C.mBody.push_back(Rename(b, renamed));
+		}
+		gTrail.UnWind(index);
+		return true;
+	}
+	return false;
+}
+
+void Unfold()
+{
+	for (auto& p : gProgram)
+	{
+		for (Clause& c : p.second.mClauses)
+		{
+			while (UnfoldClause(c))
+			{
+			}
+		}
+	}
+
+	for (auto& p : gProgram)
+	{
+		for (Clause& c : p.second.mClauses)
+		{
+			FindGuard(c);
+		}
+		p.second.mStatsStale = true;
+		if (!p.second.mClauses.empty())
+		{
+			Analyse(p.second);
+		}
+	}
+	gModesStale = true;
+}
+
+void Refold()
+{
+	for (auto& p : gProgram)
+	{
+		bool restored = false;
+		for (Clause& c : p.second.mClauses)
+		{
+			if (c.mSourceHead != nullptr)
+			{
+				c.mHead = c.mSourceHead;
+				c.mBody = c.mSourceBody;
+				c.mSourceHead = nullptr;
+				c.mSourceBody.clear();
+				restored = true;
+			}
+		}
+		p.second.mInlined = false;
+		if (restored)
+		{
+			Invalidate(p.first);
+		}
+	}
+	Unfold();
+}
+
+/*
+Goal ordering. A conjunction over facts can be run in any order and give the same answers, but not at the same cost:
+
+	capital( Country, City ), borders( Country, spain ).
+
+tries every capital and then looks for a border with spain, while the other way round finds the one country bordering spain first and then
+looks its capital up directly. Collect() gathers simple statistics for a predicate made up only of facts - how many there are, and how many
+distinct values each argument takes. A goal is then estimated to return the number of facts divided by the number of distinct values in each
+of its bound arguments, and Reorder() greedily picks the cheapest goal next, treating its variables as bound from then on - but only those
+in arguments that are ground in every fact. A fact such as likes( X, tea ) leaves a goal's first argument as free as it found it, and
+counting it as bound would make the goals after it look cheaper than they are. Anything that isn't a call to facts - a rule, a cut, a type
+test - keeps its place, and goals are only moved within the runs between them.
+*/
+
+bool Ground(Term* t);
+
+void Collect(Predicate& P)
+{
+	P.mFacts = true;
+	P.mDistinct.clear();
+	P.mGround.clear();
+	for (Clause& c : P.mClauses)
+	{
+		P.mFacts = P.mFacts && c.mBody.empty();
+	}
+
+	int arity = P.mClauses.empty() ? 0 : P.mClauses[0].mHead->mAtom.mArity;
+	for (int i = 0; i < arity; i++)
+	{
+		std::set<std::string> values;
+		for (Clause& c : P.mClauses)
+		{
+			Term* a = c.mHead->mAtom.mTerms[i];
+			if (a->mType == eAtom)
+			{
+				values.insert(Functor(a));
+			}
+		}
+		P.mDistinct.push_back(values.empty() ? 1 : (int)values.size());
+		bool ground = true;
+		for (Clause& c : P.mClauses)
+		{
+			ground = ground && Ground(c.mHead->mAtom.mTerms[i]);
+		}
+		P.mGround.push_back(ground);
+	}
+	P.mStatsStale = false;
+}
+
+Predicate* Facts(Term* Goal)
+{
+	auto it = gProgram.find(Functor(Goal));
+	if (it == gProgram.end() || it->second.mClauses.empty())
+	{
+		return nullptr;
+	}
+	if (it->second.mStatsStale)
+	{
+		Collect(it->second);
+	}
+	return it->second.mFacts ? &it->second : nullptr;
+}
+
+double Estimate(Predicate* P, Term* Goal, std::set<Term*>& Bound)
+{
+	double estimate = (double)P->mClauses.size();
+	for (int i = 0; i < Goal->mAtom.mArity; i++)
+	{
+		std::vector<Term*> vars;
+		Variables(Goal->mAtom.mTerms[i], vars);
+		bool bound = true;
+		for (Term* v : vars)
+		{
+			bound = bound && Bound.count(v) != 0;
+		}
+		if (bound)
+		{
+			estimate /= P->mDistinct[i];
+		}
+	}
+	return estimate;
+}
+
+std::vector<Term*> Reorder(std::vector<Term*> Goals, std::vector<Term*> Parameters = {})
+{
+	std::set<Term*> bound(Parameters.begin(), Parameters.end());
+	std::vector<Term*> ordered;
+	size_t start = 0;
+
+	while (start < Goals.size())
+	{
+		size_t end = start;
+		while (end < Goals.size() && Facts(Goals[end]) != nullptr)
+		{
+			end++;
+		}
+
+		std::vector<Term*> run(Goals.begin() + start, Goals.begin() + end);
+		while (!run.empty())
+		{
+			size_t best = 0;
+			double cheapest = 0;
+			for (size_t i = 0; i < run.size(); i++)
+			{
+				double estimate = Estimate(Facts(run[i]), run[i], bound);
+				if (i == 0 || estimate < cheapest)
+				{
+					best = i;
+					cheapest = estimate;
+				}
+			}
+			ordered.push_back(run[best]);
+			Predicate* facts = Facts(run[best]);
+			for (int i = 0; i < run[best]->mAtom.mArity; i++)
+			{
+				if (facts->mGround[i])
+				{
+					std::vector<Term*> vars;
+					Variables(run[best]->mAtom.mTerms[i], vars);
+					bound.insert(vars.begin(), vars.end());
+				}
+			}
+			run.erase(run.begin() + best);
+		}
+
+		if (end < Goals.size())
+		{
+			ordered.push_back(Goals[end]);
+			std::vector<Term*> vars;
+			Variables(Goals[end], vars);
+			bound.insert(vars.begin(), vars.end());
+		}
+		start = end + 1;
+	}
+	return ordered;
+}
+
+/*
+Prepared queries. A service asks the same question over and over with different constants - capital( Country, City ) for whatever country
+came in. Building the query term each time and sending it through Call() repeats the same work: looking the predicate up by name, checking the
+modes, and building a continuation per goal. Prepare() does all of that once, and each goal is then called through Invoke(), so it is
+tabled, memoised or sharded just as it would be from Call(). The parameters are ordinary variables in the goals, and Run()
+binds them to the arguments, runs the goals, and unbinds them again when the query is retried past the start - or when it returns without
+being retried, as when K stops at the first answer.
+
+The goals keep their written order and the chain of continuations between them is built once, so a run doesn't rebuild the query or look
+anything up. Resolving each goal still makes its closures and renamed clauses, as any call does. The price is that a Prepared belongs to one thread and runs one query at a time, like a prepared statement on a database connection.
+*/
+
+struct Prepared
+{
+	std::vector<Term*>			mGoals;
+	std::vector<std::string>	mFunctors;
+	std::vector<Predicate*>		mPredicates;	// nullptr for built-ins
+	std::vector<Term*>			mParameters;
+	std::vector<Continuation>	mSteps;			// mSteps[i] runs goal i, then mSteps[i + 1]
+	Continuation				mK;				// set by each Run()
+	Retry						mCut;
+};
+
+Prepared* Prepare(std::vector<Term*> Goals, std::vector<Term*> Parameters)
+{
+	if (gModesStale)
+	{
+		Infer();
+	}
+
+	Prepared* q = new Prepared();
+	q->mGoals = Goals;
+	q->mParameters = Parameters;
+	for (Term* g : Goals)
+	{
+		q->mFunctors.push_back(Functor(g));
+		auto it = gProgram.find(q->mFunctors.back());
+		q->mPredicates.push_back(it == gProgram.end() ? nullptr : &it->second);
+	}
+
+	q->mSteps.resize(Goals.size() + 1);
+	for (size_t i = 0; i < Goals.size(); i++)
+	{
+		q->mSteps[i] = [q, i](Retry R) {
+			if (q->mPredicates[i] != nullptr)
+			{
+				Invoke(q->mFunctors[i], q->mPredicates[i], q->mGoals[i], q->mSteps[i + 1], R);
+			}
+			else
+			{
+				Call(q->mGoals[i], q->mSteps[i + 1], R, q->mCut);
+			}
+		};
+	}
+	q->mSteps[Goals.size()] = [q](Retry R) { q->mK(R); };
+	return q;
+}
+
+void Run(Prepared* Q, std::vector<Term*> Arguments, Continuation K, Retry R)
+{
+	if (gModesStale)
+	{
+		Infer();
+	}
+
+	int index = gTrail.mTrail.size();
+	auto r = [index, R]() {
+		gTrail.UnWind(index);
+		R();
+	};
+
+	for (size_t i = 0; i < Q->mParameters.size(); i++)
+	{
+		Bind(Q->mParameters[i], Arguments[i]);
+	}
+
+	Q->mK = K;
+	Q->mCut = r;
+	Q->mSteps[0](r);
+	if (gTrail.mTrail.size() > (size_t)index)
+	{
+		gTrail.UnWind(index);
+	}
+}
+
+/*
+Batches. Looking a million events up one at a time means a million trips through Call(), each with its own lookup, renaming, unification
+and retries. BatchCall() takes the whole column of inputs at once. The pattern names the predicate, with a variable in the Input argument
+that each input is substituted for, and the answers come back as columns aligned by mRows, the input each answer came from:
+
+	capital( Country, City ) over [ spain, italy, germany ]  ->  rows 0 1, countries spain italy, cities madrid rome
+
+When the predicate is made of ground facts, every input is ground and the other arguments of the pattern are distinct variables, there is
+nothing for the machinery to do - matching a ground input against a ground fact is just comparing them. The facts are indexed once by their Input argument for the whole batch, and each input only compares against the facts in its bucket,
+writing matches straight into the columns - no variables, no trail, no continuations. Anything else is solved one input at a time, since
+an input with variables in it has to be unified with each fact and would be bound by the answer.
+*/
+
+struct Columns
+{
+	std::vector<size_t>				mRows;		// which input each answer came from
+	std::vector<std::vector<Term*>>	mValues;	// one column per argument of the pattern
+};
+
+bool Ground(Term* t)
+{
+	std::vector<Term*> vars;
+	Variables(Deref(t), vars);
+	for (Term* v : vars)
+	{
+		if (Deref(v)->mType == eVariable)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Equal(Term* t0, Term* t1)
+{
+	t0 = Deref(t0);
+	t1 = Deref(t1);
+	if (t0->mType == eVariable || t1->mType == eVariable)
+	{
+		return t0 == t1;
+	}
+	if (!SameFunctor(t0, t1))
+	{
+		return false;
+	}
+	for (int i = 0; i < t0->mAtom.mArity; i++)
+	{
+		if (!Equal(t0->mAtom.mTerms[i], t1->mAtom.mTerms[i]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Batchable(Predicate* P, Term* Pattern, int Input, std::vector<Term*>& Inputs)
+{
+	if (P == nullptr)
+	{
+		return false;
+	}
+	for (Clause& c : P->mClauses)
+	{
+		if (!Ground(c.mHead))
+		{
+			return false;
+		}
+	}
+	for (Term* in : Inputs)
+	{
+		if (!Ground(in))
+		{
+			return false;
+		}
+	}
+
+	std::set<Term*> outputs = { Deref(Pattern->mAtom.mTerms[Input]) };		// so p( X, X ) isn't taken for p( X, _ )
+	for (int i = 0; i < Pattern->mAtom.mArity; i++)
+	{
+		Term* a = Deref(Pattern->mAtom.mTerms[i]);
+		if (i != Input && (a->mType != eVariable || !outputs.insert(a).second))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+Columns BatchCall(Term* Pattern, int Input, std::vector<Term*>& Inputs)
+{
+	Columns result;
+	result.mValues.resize(Pattern->mAtom.mArity);
+	Predicate* p = Facts(Pattern);
+
+	if (Batchable(p, Pattern, Input, Inputs))
+	{
+		std::unordered_map<std::string, std::vector<Term*>> index;
+		for (Clause& c : p->mClauses)
+		{
+			index[Functor(c.mHead->mAtom.mTerms[Input])].push_back(c.mHead);
+		}
+
+		for (size_t row = 0; row < Inputs.size(); row++)
+		{
+			Term* in = Deref(Inputs[row]);
+			auto bucket = index.find(Functor(in));
+			if (bucket == index.end())
+			{
+				continue;
+			}
+			for (Term* head : bucket->second)
+			{
+				if (in->mAtom.mArity == 0 || Equal(in, head->mAtom.mTerms[Input]))
+				{
+					result.mRows.push_back(row);
+					for (int i = 0; i < head->mAtom.mArity; i++)
+					{
+						result.mValues[i].push_back(head->mAtom.mTerms[i]);
+					}
+				}
+			}
+		}
+		return result;
+	}
+
+	for (size_t row = 0; row < Inputs.size(); row++)
+	{
+		std::map<Term*, Term*> fresh;
+		fresh[Deref(Pattern->mAtom.mTerms[Input])] = Inputs[row];
+		Term* goal = Rename(Pattern, fresh);
+		Solve(goal, [&result, goal, row](Retry R) {
+			std::map<Term*, Term*> copy;
+			result.mRows.push_back(row);
+			for (int i = 0; i < goal->mAtom.mArity; i++)
+			{
+				result.mValues[i].push_back(Rename(goal->mAtom.mTerms[i], copy));
+			}
+			R();
+		}, []() {});
+	}
+	return result;
+}
+
+/*
+Materialised views. Some derived relations are asked about far more often than the facts under them change - reachability over a graph, say:
+
+	reach( X, Y ) :- edge( X, Y ).
+	reach( X, Z ) :- edge( X, Y ), reach( Y, Z ).
+
+Materialise() solves such a predicate completely and keeps the answers as facts, so a query is just a lookup; the rules move into a View, out
+of the program. Recomputing everything when an edge is added or removed would cost as much as the relation is big, so changes are propagated
+instead. Every fact that is added or removed is a delta, and for each rule with a goal the delta could match, Derive() solves that rule with
+the goal unified to the delta and the rest of the body against the current facts ( with no goal given, it unifies the head instead, or
+solves the whole rule ). Whatever heads come out are the new ( or lost ) answers,
+and become deltas themselves - which is how a change travels through a recursive view, or a view over another view.
+
+Adding is straightforward - each new answer is added to the table and queued. Removing is the DRed ( delete and re-derive ) algorithm: first
+everything that had a derivation through the removed fact is deleted, which over-deletes anything that can also be derived another way, then
+each of those is checked for a derivation from what remains and put back if it has one. Either way, the work done follows the size of the
+change rather than the size of the relation. Views must be range restricted - every head variable appears in the body - so that every answer
+is ground; answers that aren't are ignored.
+*/
+
+struct View
+{
+	std::vector<Clause>		mRules;
+	std::set<std::string>	mTable;		// Key() of every answer
+};
+
+std::map<std::string, View>	gViews;
+
+std::string Key(Term* t)
+{
+	t = Deref(t);
+	if (t->mType == eVariable)
+	{
+		return "_";
+	}
+
+	std::string key = t->mAtom.mName;
+	for (int i = 0; i < t->mAtom.mArity; i++)
+	{
+		key += (i == 0 ? "(" : ",") + Key(t->mAtom.mTerms[i]);
+	}
+	return t->mAtom.mArity == 0 ? key : key + ")";
+}
+
+void Derive(Clause& Rule, int Position, Term* Delta, std::vector<Term*>& Heads)
+{
+	std::map<Term*, Term*> fresh;
+	Term* head = Rename(Rule.mHead, fresh);
+	Term* goal = Position < 0 && Delta != nullptr ? head : nullptr;
+	Body rest = std::make_shared<std::vector<Term*>>();
+	for (int i = 0; i < (int)Rule.mBody.size(); i++)
+	{
+		Term* g = Rename(Rule.mBody[i], fresh);
+		if (i == Position)
+		{
+			goal = g;
+		}
+		else
+		{
+			rest->push_back(g);
+		}
+	}
+
+	int index = gTrail.mTrail.size();
+	Continuation collect = [head, &Heads](Retry R) {
+		if (Ground(head))
+		{
+			std::map<Term*, Term*> copy;
+			Heads.push_back(Rename(head, copy));
+		}
+		R();
+	};
+	Continuation body = [rest, collect](Retry R) {
+		if (rest->empty())
+		{
+			collect(R);
+		}
+		else
+		{
+			SolveBody(rest, 0, collect, R, R);
+		}
+	};
+
+	if (goal != nullptr)
+	{
+		Unify(goal, Delta, body, []() {});
+	}
+	else
+	{
+		body([]() {});
+	}
+	gTrail.UnWind(index);
+}
+
+bool RemoveClause(Term* Fact)
+{
+	auto it = gProgram.find(Functor(Fact));
+	if (it == gProgram.end())
+	{
+		return false;
+	}
+
+	Predicate& p = it->second;
+	for (size_t i = 0; i < p.mClauses.size(); i++)
+	{
+		if (p.mClauses[i].mBody.empty() && Equal(p.mClauses[i].mHead, Fact))
+		{
+			Invalidate(it->first);
+			p.mClauses.erase(p.mClauses.begin() + i);
+			p.mStatsStale = true;
+			if (p.mCalls != nullptr)
+			{
+				Reprioritise(&p);
+			}
+			if (p.mInlined)
+			{
+				Refold();
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+template<typename F> void Dependents(Term* Delta, F Each)
+{
+	std::string functor = Functor(Delta);
+	for (auto& v : gViews)
+	{
+		for (Clause& rule : v.second.mRules)
+		{
+			for (int i = 0; i < (int)rule.mBody.size(); i++)
+			{
+				if (Functor(rule.mBody[i]) == functor)
+				{
+					Each(v.second, rule, i);
+				}
+			}
+		}
+	}
+}
+
+void Notify(Term* Fact);
+
+void Insert(std::vector<Term*> Work, bool Announce = true)
+{
+	while (!Work.empty())
+	{
+		Term* delta = Work.back();
+		Work.pop_back();
+
+		std::vector<Term*> added;
+		Dependents(delta, [delta, &added](View& V, Clause& Rule, int Position) {
+			std::vector<Term*> heads;
+			Derive(Rule, Position, delta, heads);
+			for (Term* h : heads)
+			{
+				if (V.mTable.insert(Key(h)).second)
+				{
+					added.push_back(h);
+				}
+			}
+		});
+
+		for (Term* h : added)
+		{
+			AddClause(h, {});
+			if (Announce)
+			{
+				Notify(h);
+			}
+			Work.push_back(h);
+		}
+	}
+}
+
+bool Derivable(View& V, Term* Answer)
+{
+	for (Clause& rule : V.mRules)
+	{
+		std::vector<Term*> heads;
+		Derive(rule, -1, Answer, heads);
+		if (!heads.empty())
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void Delete(Term* Fact)
+{
+	std::vector<Term*> deleted = { Fact };
+	std::vector<Term*> work = { Fact };
+	std::set<std::string> seen;
+
+	while (!work.empty())
+	{
+		Term* delta = work.back();
+		work.pop_back();
+		Dependents(delta, [delta, &deleted, &work, &seen](View& V, Clause& Rule, int Position) {
+			std::vector<Term*> heads;
+			Derive(Rule, Position, delta, heads);
+			for (Term* h : heads)
+			{
+				std::string key = Key(h);
+				if (V.mTable.count(key) != 0 && seen.insert(key).second)
+				{
+					deleted.push_back(h);
+					work.push_back(h);
+				}
+			}
+		});
+	}
+
+	for (Term* d : deleted)
+	{
+		RemoveClause(d);
+		auto v = gViews.find(Functor(d));
+		if (v != gViews.end())
+		{
+			v->second.mTable.erase(Key(d));
+		}
+	}
+
+	for (size_t i = 1; i < deleted.size(); i++)
+	{
+		View& v = gViews[Functor(deleted[i])];
+		if (v.mTable.count(Key(deleted[i])) == 0 && Derivable(v, deleted[i]))
+		{
+			v.mTable.insert(Key(deleted[i]));
+			AddClause(deleted[i], {});
+			Insert({ deleted[i] }, false);
+		}
+	}
+}
+
+void Materialise(const char* Name)
+{
+	Predicate& p = gProgram[Name];
+	View& v = gViews[Name];
+	v.mRules = p.mClauses;
+	p.mClauses.clear();
+	p.mOrder = nullptr;
+	p.mKey = -1;
+	gModesStale = true;
+
+	bool grown = true;
+	while (grown)
+	{
+		grown = false;
+		for (Clause& rule : v.mRules)
+		{
+			std::vector<Term*> heads;
+			Derive(rule, -1, nullptr, heads);
+			for (Term* h : heads)
+			{
+				if (v.mTable.insert(Key(h)).second)
+				{
+					AddClause(h, {});
+					grown = true;
+				}
+			}
+		}
+	}
+}
+
+/*
+Standing queries. Polling - asking the same question every so often to see if anything new turns up - repeats all the work that found the
+old answers. Subscribe() registers a conjunction instead, along with a template for its answers and somewhere to deliver them:
+
+	hop( A, C ) for edge( A, B ), edge( B, C )
+
+When a fact is asserted, any answer it makes possible must use it in one of the goals, so Notify() runs the same delta join as the views -
+Derive() with the new fact unified to each goal it could match in turn, and the rest of the conjunction against the facts as they now are.
+Only answers that need the new fact come out. That doesn't make them new to the subscriber, though: a fact that matches two goals can
+produce the same answer from both, a fact asserted twice produces its answers twice, and a second way of deriving an answer produces it
+again. So each standing query keeps the answers it has delivered and delivers only ones it hasn't. Answers added to a materialised view are
+announced the same way, so a standing query can sit on top of a view; answers a retract took away and put back are not new, and aren't
+announced.
+
+A retract can take a delivered answer away, and if it is derived again later it is new again. Withdraw() checks, after each retract, whether
+the answers delivered to the standing queries the retract could touch can still be derived, and forgets any that can't.
+*/
+
+struct Standing
+{
+	Clause							mQuery;		// the answer template as the head, the conjunction as the body
+	std::function<void(Term*)>		mDeliver;
+	std::map<std::string, Term*>	mDelivered;	// by Key(), every answer delivered that can still be derived
+};
+
+std::vector<Standing>	gStanding;
+
+void Subscribe(Term* Answer, std::vector<Term*> Goals, std::function<void(Term*)> Deliver)
+{
+	Clause query = { Answer, Goals, -1, false, {}, std::make_shared<Profile>(), nullptr, {} };
+	gStanding.push_back({ query, Deliver, {} });
+}
+
+void Notify(Term* Fact)
+{
+	std::string functor = Functor(Fact);
+	for (size_t q = 0; q < gStanding.size(); q++)
+	{
+		std::vector<Term*> answers;
+		for (int i = 0; i < (int)gStanding[q].mQuery.mBody.size(); i++)
+		{
+			if (Functor(gStanding[q].mQuery.mBody[i]) == functor)
+			{
+				Derive(gStanding[q].mQuery, i, Fact, answers);
+			}
+		}
+
+		for (Term* a : answers)
+		{
+			if (gStanding[q].mDelivered.emplace(Key(a), a).second)
+			{
+				gStanding[q].mDeliver(a);
+			}
+		}
+	}
+}
+
+void Withdraw(Term* Fact)
+{
+	std::string functor = Functor(Fact);
+	for (Standing& s : gStanding)
+	{
+		bool affected = false;
+		for (Term* g : s.mQuery.mBody)
+		{
+			affected = affected || Functor(g) == functor || gViews.count(Functor(g)) != 0;
+		}
+		for (auto it = s.mDelivered.begin(); affected && it != s.mDelivered.end();)
+		{
+			std::vector<Term*> heads;
+			Derive(s.mQuery, -1, it->second, heads);
+			it = heads.empty() ? s.mDelivered.erase(it) : std::next(it);
+		}
+	}
+}
+
+/*
+Assert() and Retract() are the public way to change the program. A fact that any view depends on is propagated, and standing queries are told
+about new facts; anything else is just added or removed. Retract() takes a ground fact. A fact of a sharded predicate goes to its shard
+instead, and Assert() returns false if the shard couldn't be reached to take it.
+*/
+
+bool Place(Term* Fact, bool Adding, bool& Present);
+
+bool Assert(Term* Head, std::vector<Term*> Body = {})
+{
+	bool placed;
+	if (Body.empty() && Place(Head, true, placed))
+	{
+		return placed;
+	}
+
+	AddClause(Head, Body);
+	if (!Body.empty())
+	{
+		return true;
+	}
+
+	Notify(Head);
+	bool dependents = false;
+	Dependents(Head, [&dependents](View&, Clause&, int) { dependents = true; });
+	if (dependents)
+	{
+		Insert({ Head });
+	}
+	return true;
+}
+
+bool Retract(Term* Fact)
+{
+	bool placed;
+	if (Place(Fact, false, placed))
+	{
+		return placed;
+	}
+
+	bool dependents = false;
+	Dependents(Fact, [&dependents](View&, Clause&, int) { dependents = true; });
+	if (!dependents)
+	{
+		bool removed = RemoveClause(Fact);
+		Withdraw(Fact);
+		return removed;
+	}
+
+	auto it = gProgram.find(Functor(Fact));
+	bool present = false;
+	for (size_t i = 0; it != gProgram.end() && i < it->second.mClauses.size() && !present; i++)
+	{
+		present = it->second.mClauses[i].mBody.empty() && Equal(it->second.mClauses[i].mHead, Fact);
+	}
+	if (present)
+	{
+		Delete(Fact);
+		Withdraw(Fact);
+	}
+	return present;
+}
+
+/*
+Tabling. A tabled predicate remembers its answers - the first call to each variant ( the same goal up to renaming of variables ) works them
+all out and stores them in a Table, and every later call just reads them back. It also terminates where plain resolution loops forever:
+
+	:- table path/2.
+	path( X, Y ) :- path( X, Z ), edge( Z, Y ).
+	path( X, Y ) :- edge( X, Y ).
+
+Evaluate() runs the clauses to a fixpoint. A call to a variant that is still being evaluated gets the answers found so far instead of
+recursing, and the clauses are run again until an iteration adds nothing new. A table that read one further down the stack of evaluations on
+the way isn't complete when it finishes - only that one is, once its own iterations stop - so it is evaluated again when next called.
+
+An engine can be paused part way through evaluating a table, and another engine can then call the same variant. The answers so far are no
+use to it - it isn't inside that evaluation, and nothing will iterate it to a fixpoint on its behalf - so it evaluates a private table on
+its own stack to answer that one call. Forget() takes the private table out of every list of readers and dependents, and it is dropped with
+its answers once the call is done. Whatever the call is inside is recorded as depending on the shared table, so it still goes stale with it.
+
+The answers go stale when the facts under them change, and throwing every table away on each assert would waste nearly all of them. So while
+a table is evaluated, Read() records every predicate called under it, and a table called under another records that one as a dependent.
+AddClause() and RemoveClause() then Invalidate() only the tables that read the predicate changed, and everything depending on them, which
+are evaluated again lazily on their next call.
+*/
+
+struct Table
+{
+	std::vector<Term*>		mAnswers;
+	std::set<std::string>	mKeys;			// Variant() of every answer
+	std::set<Table*>		mDependents;	// tables that called this one while being evaluated
+	bool					mValid;
+	bool					mEvaluating;
+	std::atomic<long long>	mGeneration;	// bumped by every Stale(), see Memo
+
+	Table() : mValid(false), mEvaluating(false), mGeneration(0) {}
+};
+
+std::map<std::string, Table>					gTables;
+std::map<std::string, std::set<Table*>>			gReaders;
+std::mutex										gReadersLock;
+thread_local std::vector<Table*>				gEvaluating;
+thread_local size_t								gLowest = SIZE_MAX;	// outermost table still being evaluated that was read
+long long										gEvaluations = 0;
+
+std::string Variant(Term* t, std::map<Term*, int>& Vars)
+{
+	t = Deref(t);
+	if (t->mType == eVariable)
+	{
+		auto it = Vars.emplace(t, (int)Vars.size()).first;
+		return "_" + std::to_string(it->second);
+	}
+
+	std::string key = t->mAtom.mName;
+	for (int i = 0; i < t->mAtom.mArity; i++)
+	{
+		key += (i == 0 ? "(" : ",") + Variant(t->mAtom.mTerms[i], Vars);
+	}
+	return t->mAtom.mArity == 0 ? key : key + ")";
+}
+
+void Read(const std::string& Functor)
+{
+	if (!gEvaluating.empty())
+	{
+		std::lock_guard<std::mutex> lock(gReadersLock);
+		gReaders[Functor].insert(gEvaluating.back());
+	}
+}
+
+void Stale(Table* T)
+{
+	T->mValid = false;
+	T->mGeneration++;
+
+	std::set<Table*> dependents;
+	dependents.swap(T->mDependents);
+	for (Table* d : dependents)
+	{
+		Stale(d);
+	}
+}
+
+void Invalidate(const std::string& Functor)
+{
+	std::lock_guard<std::mutex> lock(gReadersLock);
+	auto it = gReaders.find(Functor);
+	if (it == gReaders.end())
+	{
+		return;
+	}
+
+	std::set<Table*> readers;
+	readers.swap(it->second);
+	gReaders.erase(it);
+	for (Table* t : readers)
+	{
+		Stale(t);
+	}
+}
+
+void Forget(Table* T);
+void Discard(Term* t);
+
+void Evaluate(Table* T, Predicate* P, Term* Goal)
+{
+	gEvaluations++;
+	T->mAnswers.clear();
+	T->mKeys.clear();
+	T->mEvaluating = true;
+	size_t depth = gEvaluating.size();
+	gEvaluating.push_back(T);
+	Read(Functor(Goal));
+
+	size_t lowest = gLowest;
+	bool grown = true;
+	gLowest = SIZE_MAX;
+	while (grown)
+	{
+		grown = false;
+		std::map<Term*, Term*> fresh;
+		Term* g = Rename(Goal, fresh);
+		int index = gTrail.mTrail.size();
+		Resolve(P, g, [T, g, &grown](Retry R) {
+			std::map<Term*, int> vars;
+			if (T->mKeys.insert(Variant(g, vars)).second)
+			{
+				std::map<Term*, Term*> copy;
+				T->mAnswers.push_back(Rename(g, copy));
+				grown = true;
+			}
+			R();
+		}, []() {});
+		gTrail.UnWind(index);
+	}
+
+	gEvaluating.pop_back();
+	T->mEvaluating = false;
+	T->mValid = gLowest >= depth;
+	gLowest = std::min(lowest, gLowest < depth ? gLowest : SIZE_MAX);
+}
+
+void Answers(Table* T, size_t Next, Term* Goal, Continuation K, Retry R)
+{
+	if (Next >= T->mAnswers.size())
+	{
+		R();
+		return;
+	}
+
+	int index = gTrail.mTrail.size();
+	auto r = [T, Next, Goal, K, R, index]() {
+		gTrail.UnWind(index);
+		Answers(T, Next + 1, Goal, K, R);
+	};
+
+	std::map<Term*, Term*> fresh;
+	Unify(Goal, Rename(T->mAnswers[Next], fresh), K, r);
+}
+
+void TabledCall(Predicate* P, Term* Goal, Continuation K, Retry R)
+{
+	std::map<Term*, int> vars;
+	Table* t = &gTables[Variant(Goal, vars)];
+
+	if (t->mEvaluating && std::find(gEvaluating.begin(), gEvaluating.end(), t) == gEvaluating.end())
+	{
+		if (!gEvaluating.empty())
+		{
+			t->mDependents.insert(gEvaluating.back());
+		}
+		Table own;		// another engine's, see above
+		Evaluate(&own, P, Goal);
+		Forget(&own);
+		Answers(&own, 0, Goal, K, R);
+		for (Term* a : own.mAnswers)
+		{
+			Discard(a);
+		}
+		return;
+	}
+	if (t->mEvaluating)
+	{
+		gLowest = std::min(gLowest, (size_t)(std::find(gEvaluating.begin(), gEvaluating.end(), t) - gEvaluating.begin()));
+	}
+	else if (!t->mValid)
+	{
+		Evaluate(t, P, Goal);
+	}
+	if (!gEvaluating.empty() && gEvaluating.back() != t)
+	{
+		t->mDependents.insert(gEvaluating.back());
+	}
+
+	Answers(t, 0, Goal, K, R);
+}
+
+void DeclareTabled(const char* Name)
+{
+	gProgram[Name].mTabled = true;
+}
+
+/*
+Memoisation. Plenty of predicates are really functions - classify( Item, Class ) gives one answer for a given Item, and is asked the same
+thing in query after query. Unlike a table, which keeps every answer to every variant for good, a memo keeps only the single answer to calls
+whose arguments are each either ground or a plain unbound variable, and keeps as many of them as fit in a memory budget:
+
+	:- memo classify/2.
+
+The cache is keyed on the Variant() of the call and split into shards, each with its own lock and its own least recently used list, so
+threads only contend when they hit the same shard. A miss runs the predicate once, up to its first answer - a memoised predicate promises
+there is only one - and caches that answer, or the lack of one. While the miss runs the memo sits on the stack of tables being evaluated, so
+Read() records what it depends on, and a table or memo that calls it is recorded as depending on it in turn, as TabledCall() does.
+
+When anything it depends on changes, Stale() bumps the generation of mDependencies. Each shard remembers the generation its entries were
+found in and empties itself, under its own lock, the first time it sees a later one; a miss that was found in an earlier generation than the
+current one is not stored at all. Everything the cache holds is its own copy of an answer, and an evicted or dropped answer is deleted -
+its terms go back to the Arena - so the budget bounds the memory the cache holds. Atoms without arguments are shared with the program rather
+than copied by Rename(), so they are neither counted nor deleted.
+*/
+
+struct Memo
+{
+	struct Entry
+	{
+		std::string		mKey;
+		Term*			mAnswer;		// nullptr if the call failed
+		size_t			mBytes;
+	};
+
+	struct Shard
+	{
+		std::mutex													mLock;
+		std::list<Entry>											mRecent;	// most recently used first
+		std::unordered_map<std::string, std::list<Entry>::iterator>	mIndex;
+		size_t														mBytes;
+		long long													mGeneration;	// of mDependencies when its entries were found
+
+		Shard() : mBytes(0), mGeneration(0) {}
+	};
+
+	Shard	mShards[16];
+	size_t	mBudget;		// bytes, per shard
+	Table	mDependencies;
+};
+
+void Forget(Table* T)
+{
+	{
+		std::lock_guard<std::mutex> lock(gReadersLock);
+		for (auto& r : gReaders)
+		{
+			r.second.erase(T);
+		}
+	}
+	for (auto& t : gTables)
+	{
+		t.second.mDependents.erase(T);
+	}
+	for (auto& p : gProgram)
+	{
+		if (p.second.mMemo != nullptr)
+		{
+			p.second.mMemo->mDependencies.mDependents.erase(T);
+		}
+	}
+}
+
+std::atomic<long long>	gMemoHits(0);
+std::atomic<long long>	gMemoMisses(0);
+
+size_t Size(Term* t)
+{
+	if (t->mType == eAtom && t->mAtom.mArity == 0)
+	{
+		return 0;
+	}
+	size_t size = sizeof(Term);
+	for (int i = 0; t->mType == eAtom && i < t->mAtom.mArity; i++)
+	{
+		size += Size(t->mAtom.mTerms[i]);
+	}
+	return size;
+}
+
+void Discard(Term* t)
+{
+	if (t->mType == eAtom && t->mAtom.mArity == 0)
+	{
+		return;
+	}
+	for (int i = 0; t->mType == eAtom && i < t->mAtom.mArity; i++)
+	{
+		Discard(t->mAtom.mTerms[i]);
+	}
+	delete t;
+}
+
+bool Memoisable(Term* Goal)
+{
+	for (int i = 0; i < Goal->mAtom.mArity; i++)
+	{
+		Term* a = Deref(Goal->mAtom.mTerms[i]);
+		if (a->mType == eAtom && !Ground(a))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void Renew(Memo::Shard& S, long long Generation)
+{
+	if (S.mGeneration >= Generation)
+	{
+		return;
+	}
+	for (Memo::Entry& e : S.mRecent)
+	{
+		if (e.mAnswer != nullptr)
+		{
+			Discard(e.mAnswer);
+		}
+	}
+	S.mRecent.clear();
+	S.mIndex.clear();
+	S.mBytes = 0;
+	S.mGeneration = Generation;
+}
+
+/*
+Lookup() hands back a copy of the answer, made under the shard's lock, as another thread may evict and delete the cached one as soon as the
+lock is let go.
+*/
+
+bool Lookup(Memo* M, const std::string& Key, long long Generation, Term*& Answer)
+{
+	Memo::Shard& shard = M->mShards[std::hash<std::string>()(Key) % 16];
+	std::lock_guard<std::mutex> lock(shard.mLock);
+	Renew(shard, Generation);
+	auto it = shard.mIndex.find(Key);
+	if (shard.mGeneration != Generation || it == shard.mIndex.end())
+	{
+		return false;
+	}
+	shard.mRecent.splice(shard.mRecent.begin(), shard.mRecent, it->second);
+	std::map<Term*, Term*> fresh;
+	Answer = it->second->mAnswer != nullptr ? Rename(it->second->mAnswer, fresh) : nullptr;
+	return true;
+}
+
+void Store(Memo* M, const std::string& Key, long long Generation, Term* Answer)
+{
+	Memo::Shard& shard = M->mShards[std::hash<std::string>()(Key) % 16];
+	std::lock_guard<std::mutex> lock(shard.mLock);
+	if (Generation != M->mDependencies.mGeneration)
+	{
+		return;		// something it was worked out from has changed since
+	}
+	Renew(shard, Generation);
+	if (shard.mIndex.count(Key) != 0)
+	{
+		return;
+	}
+
+	std::map<Term*, Term*> copy;
+	Term* answer = Answer != nullptr ? Rename(Answer, copy) : nullptr;
+	size_t bytes = sizeof(Memo::Entry) + 2 * Key.size() + (answer != nullptr ? Size(answer) : 0);
+	shard.mRecent.push_front({ Key, answer, bytes });
+	shard.mIndex[Key] = shard.mRecent.begin();
+	shard.mBytes += bytes;
+	while (shard.mBytes > M->mBudget && shard.mRecent.size() > 1)
+	{
+		Memo::Entry& last = shard.mRecent.back();
+		shard.mBytes -= last.mBytes;
+		if (last.mAnswer != nullptr)
+		{
+			Discard(last.mAnswer);
+		}
+		shard.mIndex.erase(last.mKey);
+		shard.mRecent.pop_back();
+	}
+}
+
+void MemoCall(Predicate* P, Term* Goal, Continuation K, Retry R)
+{
+	Memo* m = P->mMemo.get();
+	if (!Memoisable(Goal))
+	{
+		Resolve(P, Goal, K, R);
+		return;
+	}
+	if (!gEvaluating.empty() && gEvaluating.back() != &m->mDependencies)
+	{
+		std::lock_guard<std::mutex> lock(gReadersLock);
+		m->mDependencies.mDependents.insert(gEvaluating.back());
+	}
+
+	std::map<Term*, int> vars;
+	std::string key = Variant(Goal, vars);
+	long long generation = m->mDependencies.mGeneration;
+	Term* answer = nullptr;
+	if (Lookup(m, key, generation, answer))
+	{
+		gMemoHits++;
+	}
+	else
+	{
+		gMemoMisses++;
+		std::map<Term*, Term*> fresh;
+		Term* g = Rename(Goal, fresh);
+		int index = gTrail.mTrail.size();
+
+		gEvaluating.push_back(&m->mDependencies);
+		Read(Functor(Goal));
+		Resolve(P, g, [g, &answer](Retry) {
+			std::map<Term*, Term*> copy;
+			answer = Rename(g, copy);
+		}, []() {});
+		gEvaluating.pop_back();
+
+		gTrail.UnWind(index);
+		bool stopped = gInferences > gInferenceLimit || (gCancel != nullptr && gCancel->load());
+		if (stopped)
+		{
+			return;		// a halted search proves nothing, so cache nothing
+		}
+		Store(m, key, generation, answer);
+	}
+
+	if (answer == nullptr)
+	{
+		R();
+		return;
+	}
+	Unify(Goal, answer, K, R);
+}
+
+void DeclareMemo(const char* Name, size_t Budget)
+{
+	Predicate& p = gProgram[Name];
+	p.mMemo = std::make_shared<Memo>();
+	p.mMemo->mBudget = Budget / 16;
+}
+
+/*
+Engines. A query run with Solve() has its thread until it finishes - control only comes back once the chain of continuations in main()
+returns, and a long analytic query holds up every short one queued behind it. An Engine is a query that can be put down part way and picked
+up again later. Each one runs on its own stack, and Halted() - which every step of a search already goes through - is the safe point: once an
+engine has used up its slice of inferences, Yield() saves where it is with swapcontext() and returns to whoever called Resume(). The stack
+is reserved but not committed, so only the pages an engine actually touches cost memory, and thousands of them can be paused at once. It
+does still bound how far one engine can get: in this machine the stack grows with every inference that hasn't been cut away.
+
+Everything the machine keeps per thread belongs to the engine while it runs - its trail, its inference count and limit, its cancel flag and
+the tables it is evaluating - so Switch() swaps them in and out around each slice. An engine stays on the thread that first resumed it: the
+compiler is free to keep the address of a thread_local in a register across the call to Yield(), and that would be wrong on any other thread.
+*/
+
+enum EngineState
+{
+	eEngineNew,
+	eEngineReady,
+	eEngineDone
+};
+
+struct Engine
+{
+	Term*						mGoal;
+	std::function<void(Term*)>	mAnswer;		// called with mGoal bound, on the engine's own stack
+	int							mWeight;
+	EngineState					mState;
+	std::thread::id				mThread;
+	ucontext_t					mContext;
+	ucontext_t					mCaller;
+	char*						mStack;
+	size_t						mStackSize;
+
+	std::vector<Trail::Entry>	mTrail;
+	long long					mInferences;
+	long long					mLimit;
+	std::atomic<bool>			mCancelled;
+	std::atomic<bool>*			mCancel;
+	std::vector<Table*>			mEvaluating;
+	size_t						mLowest;
+	int							mShardsLost;
+	long long					mTermBytes;
+
+	double						mPass;			// see Scheduler
+	long long					mSlices;
+	size_t						mStackUsed;		// the most seen at a Yield()
+	bool						mWaiting;		// on a read, see ReadBytes()
+};
+
+thread_local Engine*	gEngine = nullptr;
+
+Engine* mkEngine(Term* Goal, std::function<void(Term*)> Answer, int Weight = 1, long long Limit = LLONG_MAX)
+{
+	Engine* e = new Engine;
+	e->mGoal = Goal;
+	e->mAnswer = Answer;
+	e->mWeight = Weight < 1 ? 1 : Weight;
+	e->mState = eEngineNew;
+	e->mStack = nullptr;
+	e->mStackSize = 64 << 20;
+	e->mInferences = 0;
+	e->mLimit = Limit;
+	e->mCancelled.store(false);
+	e->mCancel = &e->mCancelled;
+	e->mLowest = SIZE_MAX;
+	e->mShardsLost = 0;
+	e->mTermBytes = 0;
+	e->mPass = 0;
+	e->mSlices = 0;
+	e->mStackUsed = 0;
+	e->mWaiting = false;
+	return e;
+}
+
+void Switch(Engine* E)
+{
+	std::swap(gTrail.mTrail, E->mTrail);
+	std::swap(gInferences, E->mInferences);
+	std::swap(gInferenceLimit, E->mLimit);
+	std::swap(gCancel, E->mCancel);
+	std::swap(gEvaluating, E->mEvaluating);
+	std::swap(gLowest, E->mLowest);
+	std::swap(gShardsLost, E->mShardsLost);
+	std::swap(gTermBytes, E->mTermBytes);
+}
+
+void Yield()
+{
+	Engine* e = gEngine;
+	if (e != nullptr)
+	{
+		char here;
+		e->mStackUsed = std::max(e->mStackUsed, (size_t)(e->mStack + e->mStackSize - &here));
+		swapcontext(&e->mContext, &e->mCaller);
+	}
+}
+
+void Start()
+{
+	Engine* e = gEngine;
+	Solve(e->mGoal, [e](Retry R) { e->mAnswer(e->mGoal); R(); }, []() {});
+	e->mState = eEngineDone;
+}
+
+/*
+Resume() runs an engine for at most Slice inferences and says whether it has more to do. Cancel() asks it to stop at its next safe point,
+which it does the next time it is resumed - the search simply unwinds, as it would for any other halt. An engine waiting on a read (see
+ReadBytes()) isn't run at all until its thread has reaped the read.
+*/
+
+bool Resume(Engine* E, long long Slice)
+{
+	if (E->mState == eEngineDone)
+	{
+		return false;
+	}
+	if (E->mWaiting)
+	{
+		return true;
+	}
+	if (E->mState == eEngineNew)
+	{
+		E->mStack = (char*)mmap(nullptr, E->mStackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+		if (E->mStack == MAP_FAILED)
+		{
+			E->mStack = nullptr;
+			E->mState = eEngineDone;
+			return false;
+		}
+		Local(E->mStack, E->mStackSize);
+		getcontext(&E->mContext);
+		E->mContext.uc_stack.ss_sp = E->mStack;
+		E->mContext.uc_stack.ss_size = E->mStackSize;
+		E->mContext.uc_link = &E->mCaller;
+		makecontext(&E->mContext, Start, 0);
+		E->mThread = std::this_thread::get_id();
+		E->mState = eEngineReady;
+	}
+	else if (E->mThread != std::this_thread::get_id())
+	{
+		return true;
+	}
+
+	Engine* outer = gEngine;
+	long long outerEnd = gSliceEnd;
+	Switch(E);
+	gEngine = E;
+	gSliceEnd = gInferences + Slice;
+	E->mSlices++;
+
+	swapcontext(&E->mCaller, &E->mContext);
+
+	gEngine = outer;
+	gSliceEnd = outerEnd;
+	Switch(E);
+
+	if (E->mState == eEngineDone)
+	{
+		munmap(E->mStack, E->mStackSize);
+		E->mStack = nullptr;
+		return false;
+	}
+	return true;
+}
+
+void Cancel(Engine* E)
+{
+	E->mCancelled.store(true);
+}
+
+/*
+Asynchronous reads. If a rule reads a file while running on the Scheduler's thread, the thread is held for as long as the disk
+takes, and every other engine on that thread is held with it. read_bytes( File, Offset, Length, Text ) instead submits the read. When called
+inside an engine, it marks the engine as waiting and yields. The thread goes on running other engines, and the waiting one is picked up again
+once its data is in, so one thread can have hundreds of reads outstanding for hundreds of queries. Outside an engine there is nothing else to
+run, and the call simply waits. Numbers are atoms in this machine, so Offset and Length are atoms like '4096'. Text is bound to an atom
+holding the bytes read, which is empty past the end of the file.
+
+	chunk( N, Text ) :- read_bytes( 'data.txt', N, '4096', Text ).
+
+Each thread has its own IoQueue. An engine only ever runs on one thread, and that thread is the one that has to notice its read is done.
+The queue uses io_uring where the kernel allows it. Reads go onto a submission ring shared with the kernel and completions come back on
+another, with one system call to submit a read and none to collect it. Where io_uring isn't available, such as on an old kernel or in a
+sandbox that forbids it, reads are handed to a small pool of threads. Each pool thread does an ordinary pread() and posts the result back to
+the submitting thread's queue. Either way completions are announced on the queue's eventfd - the ring is registered to signal it too - so
+Descriptor() polls readable when there are completions to Reap(), and an event loop can wait on it alongside its sockets.
+
+Length is capped at gLargestRead, and Offset and Length must be plain decimal numbers, or the call fails - the buffer is allocated inside an
+engine, where running out of memory has nobody to catch it.
+*/
+
+struct Pending
+{
+	Engine*		mEngine;
+	int			mFile;
+	char*		mBuffer;
+	size_t		mLength;
+	off_t		mOffset;
+	ssize_t		mResult;
+	bool		mDone;
+};
+
+bool gUseUring = true;
+
+struct IoQueue;
+
+struct IoPool
+{
+	std::mutex								mLock;
+	std::condition_variable					mReady;
+	std::deque<std::pair<IoQueue*, Pending*>>	mRequests;
+};
+
+IoPool*		gIoPool = nullptr;
+std::mutex	gIoPoolLock;
+const int	gIoThreads = 4;
+
+struct IoQueue
+{
+	int				mRing;			// -1 when reads go to the pool
+	unsigned		mEntries;
+	unsigned		mInFlight;
+	unsigned*		mSqTail;
+	unsigned*		mSqMask;
+	unsigned*		mSqArray;
+	unsigned*		mCqHead;
+	unsigned*		mCqTail;
+	unsigned*		mCqMask;
+	io_uring_sqe*	mSqes;
+	io_uring_cqe*	mCqes;
+
+	bool			mFallback;		// the kernel can't READ, see Reap()
+
+	int						mEvent;			// signalled by the ring and by the pool
+	std::mutex				mLock;
+	std::vector<Pending*>	mCompleted;
+
+	IoQueue();
+	void Submit(Pending* P);
+	void Hand(Pending* P);
+	void Reap(bool Wait);
+	int Descriptor() const { return mEvent; }
+};
+
+void Complete(Pending* P)
+{
+	P->mDone = true;
+	if (P->mEngine != nullptr)
+	{
+		P->mEngine->mWaiting = false;
+	}
+}
+
+/*
+liburing isn't needed for this much: the ring is set up with the raw system calls and the three regions the kernel shares are mapped
+directly. Newer kernels share the submission and completion rings in a single mapping.
+*/
+
+IoQueue::IoQueue() : mRing(-1), mEntries(0), mInFlight(0), mFallback(false)
+{
+	mEvent = eventfd(0, EFD_NONBLOCK);
+	if (!gUseUring)
+	{
+		return;
+	}
+
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int ring = (int)syscall(__NR_io_uring_setup, 256, &params);
+	if (ring < 0)
+	{
+		return;
+	}
+
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single)
+	{
+		sqSize = cqSize = std::max(sqSize, cqSize);
+	}
+	void* sq = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	void* cq = single ? sq : mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+	void* sqes = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED || syscall(__NR_io_uring_register, ring, IORING_REGISTER_EVENTFD, &mEvent, 1) < 0)
+	{
+		close(ring);
+		return;
+	}
+
+	mRing = ring;
+	mEntries = params.sq_entries;
+	mSqTail = (unsigned*)((char*)sq + params.sq_off.tail);
+	mSqMask = (unsigned*)((char*)sq + params.sq_off.ring_mask);
+	mSqArray = (unsigned*)((char*)sq + params.sq_off.array);
+	mCqHead = (unsigned*)((char*)cq + params.cq_off.head);
+	mCqTail = (unsigned*)((char*)cq + params.cq_off.tail);
+	mCqMask = (unsigned*)((char*)cq + params.cq_off.ring_mask);
+	mSqes = (io_uring_sqe*)sqes;
+	mCqes = (io_uring_cqe*)((char*)cq + params.cq_off.cqes);
+}
+
+thread_local IoQueue*	gIo = nullptr;
+
+IoQueue& Io()
+{
+	if (gIo == nullptr)
+	{
+		gIo = new IoQueue();
+	}
+	return *gIo;
+}
+
+void ReadForOthers(IoPool* Pool)
+{
+	for (;;)
+	{
+		std::unique_lock<std::mutex> lock(Pool->mLock);
+		Pool->mReady.wait(lock, [Pool]() { return !Pool->mRequests.empty(); });
+		auto request = Pool->mRequests.front();
+		Pool->mRequests.pop_front();
+		lock.unlock();
+
+		Pending* p = request.second;
+		p->mResult = pread(p->mFile, p->mBuffer, p->mLength, p->mOffset);
+		if (p->mResult < 0)
+		{
+			p->mResult = -errno;
+		}
+		{
+			std::lock_guard<std::mutex> guard(request.first->mLock);
+			request.first->mCompleted.push_back(p);
+		}
+		uint64_t one = 1;
+		if (write(request.first->mEvent, &one, sizeof(one)) < 0)
+		{
+			// the counter is already non-zero
+		}
+	}
+}
+
+void IoQueue::Hand(Pending* P)
+{
+	std::lock_guard<std::mutex> lock(gIoPoolLock);
+	if (gIoPool == nullptr)
+	{
+		gIoPool = new IoPool();
+		for (int i = 0; i < gIoThreads; i++)
+		{
+			std::thread([]() { ReadForOthers(gIoPool); }).detach();
+		}
+	}
+	{
+		std::lock_guard<std::mutex> guard(gIoPool->mLock);
+		gIoPool->mRequests.push_back({ this, P });
+	}
+	gIoPool->mReady.notify_one();
+}
+
+void IoQueue::Submit(Pending* P)
+{
+	if (mRing < 0 || mFallback)
+	{
+		Hand(P);
+		return;
+	}
+
+	while (mInFlight >= mEntries)
+	{
+		Reap(true);
+	}
+	unsigned tail = *mSqTail;
+	unsigned index = tail & *mSqMask;
+	io_uring_sqe* sqe = &mSqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = P->mFile;
+	sqe->addr = (uint64_t)P->mBuffer;
+	sqe->len = (uint32_t)P->mLength;
+	sqe->off = (uint64_t)P->mOffset;
+	sqe->user_data = (uint64_t)P;
+	mSqArray[index] = index;
+	__atomic_store_n(mSqTail, tail + 1, __ATOMIC_RELEASE);
+	mInFlight++;
+	syscall(__NR_io_uring_enter, mRing, 1, 0, 0, nullptr, 0);
+}
+
+/*
+Reap() marks whatever has finished as done, which makes its engine runnable again. With Wait it first blocks until at least one read is in.
+A kernel old enough to have io_uring but not its READ operation answers -EINVAL. Doing the read here instead would hold this thread, and
+every engine on it, for as long as the disk takes; so that read is handed to the pool, and so is every read this queue is given after it.
+*/
+
+void IoQueue::Reap(bool Wait)
+{
+	if (Wait)
+	{
+		pollfd p = { mEvent, POLLIN, 0 };
+		poll(&p, 1, -1);
+	}
+	uint64_t count;
+	if (read(mEvent, &count, sizeof(count)) < 0)
+	{
+		return;		// nothing has finished since last time
+	}
+
+	if (mRing >= 0)
+	{
+		unsigned head = *mCqHead;
+		unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			io_uring_cqe* cqe = &mCqes[head & *mCqMask];
+			Pending* p = (Pending*)cqe->user_data;
+			mInFlight--;
+			if (cqe->res == -EINVAL)
+			{
+				mFallback = true;
+				Hand(p);
+				continue;
+			}
+			p->mResult = cqe->res;
+			Complete(p);
+		}
+		__atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+	}
+
+	std::vector<Pending*> completed;
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		completed.swap(mCompleted);
+	}
+	for (Pending* p : completed)
+	{
+		Complete(p);
+	}
+}
+
+/*
+ReadAt() does one read through the thread's queue and answers what pread() would, or -errno. Inside an engine it yields until the read is
+in; outside one it waits. The Pending record lives on the engine's own stack, which stays where it is while the engine waits.
+ReadBytes() is the builtin itself. Opening the file is left synchronous, since it is the reads that take the time.
+*/
+
+ssize_t ReadAt(int File, char* Buffer, size_t Length, off_t Offset)
+{
+	Pending pending = { gEngine, File, Buffer, Length, Offset, 0, false };
+	IoQueue& io = Io();
+	io.Submit(&pending);
+	while (!pending.mDone)
+	{
+		if (gEngine != nullptr)
+		{
+			gEngine->mWaiting = true;
+			Yield();
+		}
+		else
+		{
+			io.Reap(true);
+		}
+	}
+	return pending.mResult;
+}
+
+const size_t	gLargestRead = 16 << 20;
+
+bool Decimal(const char* Text, unsigned long long& Value)
+{
+	if (!isdigit((unsigned char)Text[0]))
+	{
+		return false;
+	}
+	char* end;
+	errno = 0;
+	Value = strtoull(Text, &end, 10);
+	return *end == '\0' && errno == 0;
+}
+
+void ReadBytes(Term* Goal, Continuation K, Retry R)
+{
+	Term* file = Deref(Goal->mAtom.mTerms[0]);
+	Term* offset = Deref(Goal->mAtom.mTerms[1]);
+	Term* length = Deref(Goal->mAtom.mTerms[2]);
+	unsigned long long from;
+	unsigned long long bytes;
+	if (file->mType != eAtom || offset->mType != eAtom || length->mType != eAtom || !Decimal(offset->mAtom.mName, from) ||
+		!Decimal(length->mAtom.mName, bytes) || from > (unsigned long long)LLONG_MAX || bytes > gLargestRead)
+	{
+		R();
+		return;
+	}
+
+	int f = open(file->mAtom.mName, O_RDONLY);
+	if (f < 0)
+	{
+		R();
+		return;
+	}
+	std::vector<char> buffer(bytes);
+	ssize_t n = ReadAt(f, buffer.data(), buffer.size(), (off_t)from);
+	close(f);
+
+	if (n < 0)
+	{
+		R();
+		return;
+	}
+	char* text = new char[n + 1];
+	memcpy(text, buffer.data(), n);
+	text[n] = '\0';
+	Unify(Goal->mAtom.mTerms[3], mkAtom(text), K, R);
+}
+
+/*
+Lazy streams. file_lines( File, Lines ) binds Lines to the lines of a file, one atom per line, as an ordinary list - except that the list is
+only read as far as something looks at it. A search that stops at the first match never reads the rest of the file, however large it is:
+
+	error( Line ) :- file_lines( 'server.log', Lines ), member( Line, Lines ), is_error( Line ).
+
+The list ends in a lazy tail: an unbound variable carrying a Lazy record that says where in the file the rest starts. Unify() forces such a
+tail when it has to match it against a list cell or [] - it reads the next chunk of the file, builds the cells for the whole lines in it,
+and binds the tail to them, ending in another lazy tail or in []. A plain unbound variable takes a tail as it stands, so matching [_|T]
+against a list reads nothing more until T itself is matched. A clause head that would force a tail has it forced by Try() before the choice
+point rather than inside the head, so that failing the clause doesn't undo the read for the next one to repeat. member/2 and the
+other list predicates work by unification, so they see an ordinary list and need to know nothing about streams, and nonvar/1 counts a lazy
+tail as bound, as it stands for a list.
+
+Nothing else forces a tail. Deref() stops at it as at any unbound variable, so Rename(), Print(), Encode() and the table and memo stores copy
+a stream only as far as it has been read, ending in a fresh unbound variable - they never read a file, or yield, on the way through a term.
+A stream should be walked before it is kept. Indexing sees a lazy tail as unbound, and tries every clause, each of which unifies.
+
+The binding that forces a tail is trailed like any other. Backtracking to before it unbinds the tail, and nothing made since can still be
+referred to - any variable bound to one of the chunk's cells was bound later and has been unbound first. So UnWind() hands the chunk to
+Unforce(), which frees its text and its cells at once, and the tail is read again if it is ever reached again. For a list that is the only
+point a chunk is let go: the head of the list is referred to by the clause that called file_lines/2, so every chunk a failure driven loop
+such as member( Line, Lines ), fail passes stays held until the loop ends. Telling that a chunk can no longer be reached while its binding
+stands would take a garbage collector, and the machine has none - so file_lines/2 keeps memory bounded only for a search that gives up
+early, as in the example, where the cut and the failure back to the query release what was read.
+
+A whole file is walked in bounded memory with file_line( File, Line ), which gives the lines one at a time on backtracking instead of as
+a list. It builds no list for anything to refer to: a LineCursor owns the one chunk being read, hands out the lines in it, and frees it before
+reading the next. A line is only ever bound between one retry and the next, and each retry unwinds that binding first, so nothing can
+still refer to a chunk once the cursor has moved on. The cursor is shared by the retries, and goes - with its chunk - when the last of them
+does, whether the lines run out or a cut discards them:
+
+	scan :- file_line( 'server.log', Line ), is_error( Line ), report( Line ), fail.
+
+A chunk is read with ReadAt(), so an engine forcing a tail yields to the others on its thread while the disk works, as read_bytes/4 does.
+
+Lines are atoms whose names point into the chunk's text, and they go with it. Rename() copies them rather than sharing them, as it does for
+other atoms, so a line kept in a table or a memo outlives the chunk it came from. The Lazy record at the head of the list, and the file
+name every chunk shares, belong to the call of file_lines/2, and are freed once the search has backtracked past it.
+*/
+
+size_t	gStreamChunk = 64 << 10;
+
+std::atomic<long long>	gChunksRead(0);
+std::atomic<long long>	gChunksHeld(0);
+
+struct Chunk;
+
+struct Lazy
+{
+	char*	mFile;
+	off_t	mOffset;
+	Chunk*	mChunk;		// read and bound while the tail is forced
+};
+
+struct Chunk
+{
+	std::vector<char>		mText;
+	std::unique_ptr<Term[]>	mTerms;
+	Lazy					mNext;
+};
+
+/*
+A chunk is at least gStreamChunk bytes, cut back to the last whole line - unless no line ends within it, in which case it grows until one
+does or the file ends. The line after it is asked for straight away, so the disk can be reading it while these lines are worked through.
+*/
+
+Chunk* ReadChunk(char* File, off_t Offset, Term*& Head)
+{
+	Chunk* c = new Chunk;
+	int f = open(File, O_RDONLY);
+	size_t size = 0;
+	bool end = f < 0;
+	while (!end)
+	{
+		c->mText.resize(size + gStreamChunk);
+		ssize_t n = std::max(ReadAt(f, &c->mText[size], gStreamChunk, Offset + size), (ssize_t)0);
+		end = n < (ssize_t)gStreamChunk;
+		size += n;
+		if (memchr(&c->mText[size - n], '\n', n) != nullptr)
+		{
+			break;
+		}
+	}
+
+	size_t used = size;
+	if (!end)
+	{
+		while (c->mText[used - 1] != '\n')
+		{
+			used--;
+		}
+		posix_fadvise(f, Offset + used, gStreamChunk, POSIX_FADV_WILLNEED);
+	}
+	if (f >= 0)
+	{
+		close(f);
+	}
+	c->mText.resize(used + 1);
+	c->mText[used] = '\n';
+
+	size_t lines = std::count(c->mText.begin(), c->mText.begin() + used, '\n');
+	if (used > 0 && c->mText[used - 1] != '\n')
+	{
+		lines++;
+	}
+	c->mTerms.reset(new Term[2 * lines + 1]());
+
+	Term* next = &c->mTerms[2 * lines];
+	if (end)
+	{
+		next->mType = eAtom;
+		next->mAtom.mName = "[]";
+		next->mAtom.mBorrowed = true;
+	}
+	else
+	{
+		c->mNext = { File, Offset + (off_t)used, nullptr };
+		next->mType = eVariable;
+		next->mVariable.mAge = gVariableAge.fetch_add(1, std::memory_order_relaxed);
+		next->mVariable.mLazy = &c->mNext;
+	}
+
+	char* text = c->mText.data();
+	for (size_t i = 0; i < lines; i++)
+	{
+		char* eol = (char*)memchr(text, '\n', c->mText.data() + used + 1 - text);
+		*eol = '\0';
+		Term* line = &c->mTerms[2 * i];
+		line->mType = eAtom;
+		line->mAtom.mName = text;
+		line->mAtom.mBorrowed = true;
+		text = eol + 1;
+	}
+	for (size_t i = lines; i-- > 0;)
+	{
+		Term* cell = &c->mTerms[2 * i + 1];
+		cell->mType = eAtom;
+		cell->mAtom.mName = ".";
+		cell->mAtom.mArity = 2;
+		cell->mAtom.mTerms[0] = &c->mTerms[2 * i];
+		cell->mAtom.mTerms[1] = next;
+		next = cell;
+	}
+
+	gChunksRead++;
+	gChunksHeld++;
+	Head = next;
+	return c;
+}
+
+Term* Force(Term* Tail)
+{
+	Lazy* lazy = Tail->mVariable.mLazy;
+	Term* next;
+	lazy->mChunk = ReadChunk(lazy->mFile, lazy->mOffset, next);
+	Bind(Tail, next);
+	return next;
+}
+
+void Unforce(Term* Tail)
+{
+	Lazy* lazy = Tail->mVariable.mLazy;
+	delete lazy->mChunk;
+	lazy->mChunk = nullptr;
+	gChunksHeld--;
+}
+
+Term* Lines(const char* File)
+{
+	Term* tail = mkVar();
+	tail->mVariable.mLazy = new Lazy{ strdup(File), 0, nullptr };
+	return tail;
+}
+
+void FileLines(Term* Goal, Continuation K, Retry R)
+{
+	Term* file = Deref(Goal->mAtom.mTerms[0]);
+	if (file->mType != eAtom || access(file->mAtom.mName, R_OK) != 0)
+	{
+		R();
+		return;
+	}
+	size_t index = gTrail.mTrail.size();
+	Term* lines = Lines(file->mAtom.mName);
+	Unify(Goal->mAtom.mTerms[1], lines, K, R);
+	if (gTrail.mTrail.size() <= index)
+	{
+		free(lines->mVariable.mLazy->mFile);
+		delete lines->mVariable.mLazy;
+		lines->mVariable.mLazy = nullptr;
+	}
+}
+
+struct LineCursor
+{
+	char*	mFile;
+	Chunk*	mChunk = nullptr;
+
+	~LineCursor()
+	{
+		if (mChunk != nullptr)
+		{
+			delete mChunk;
+			gChunksHeld--;
+		}
+		free(mFile);
+	}
+};
+
+void NextLine(std::shared_ptr<LineCursor> C, Term* Cell, Term* Line, Continuation K, Retry R)
+{
+	if (Halted())
+	{
+		return;
+	}
+
+	if (Cell->mType == eVariable)
+	{
+		Lazy next = *Cell->mVariable.mLazy;		// lives in the chunk about to go
+		delete C->mChunk;
+		gChunksHeld--;
+		C->mChunk = ReadChunk(next.mFile, next.mOffset, Cell);
+	}
+	if (Cell->mAtom.mArity == 0)
+	{
+		R();
+		return;
+	}
+
+	size_t index = gTrail.mTrail.size();
+	Term* rest = Cell->mAtom.mTerms[1];
+	Retry retry = [C, rest, Line, index, K, R]() {
+		gTrail.UnWind(index);
+		NextLine(C, rest, Line, K, R);
+	};
+	Unify(Line, Cell->mAtom.mTerms[0], K, retry);
+}
+
+void FileLine(Term* Goal, Continuation K, Retry R)
+{
+	Term* file = Deref(Goal->mAtom.mTerms[0]);
+	if (file->mType != eAtom || access(file->mAtom.mName, R_OK) != 0)
+	{
+		R();
+		return;
+	}
+	auto cursor = std::make_shared<LineCursor>();
+	cursor->mFile = strdup(file->mAtom.mName);
+	Term* head;
+	cursor->mChunk = ReadChunk(cursor->mFile, 0, head);
+	NextLine(cursor, head, Goal->mAtom.mTerms[1], K, R);
+}
+
+/*
+A Scheduler multiplexes engines over one thread. It picks the engine that has had the least share of it so far - stride scheduling: every
+slice an engine runs advances its pass by the inferences it used divided by its weight, and the lowest pass goes next, passing over any
+engine that is waiting for a read. Every engine gets its turn, but one with weight 10 gets ten times the inferences of one with weight 1, so
+a short interactive query given a high weight finishes within its first few slices however many long ones are already running. A newly
+spawned engine starts level with the scheduler's clock rather than at zero, so it neither jumps the whole queue nor waits behind everyone's
+history.
+
+It is one thread and not a pool because engines share the one program - its clauses, modes, statistics and tables - and a slice can change
+any of them: a call re-infers the modes once an assert has left them stale, the reordering statistics are collected and counted as goals
+run, and the tables are filled in as they are evaluated. None of that is safe to do from two threads at once, and with a lock around each
+slice a pool would only take turns. Parallelism comes from processes instead - Distribute() and the shards - each with a program of its
+own. gMachineLock is still held for each slice, as the query server may be running its own engines on another thread.
+*/
+
+std::recursive_mutex	gMachineLock;		// held while a slice runs, see Scheduler
+
+struct Scheduler
+{
+	std::mutex				mLock;			// engines may be spawned from other threads
+	std::vector<Engine*>	mQueue;
+	double					mClock;
+	long long				mSlice;
+
+	Scheduler(long long Slice) : mClock(0), mSlice(Slice) {}
+};
+
+void Spawn(Scheduler& S, Engine* E)
+{
+	std::lock_guard<std::mutex> lock(S.mLock);
+	E->mPass = S.mClock;
+	S.mQueue.push_back(E);
+}
+
+/*
+Run() works until the queue is empty, including any engines spawned by the ones running.
+*/
+
+void Run(Scheduler& S)
+{
+	for (;;)
+	{
+		Engine* e = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(S.mLock);
+			if (S.mQueue.empty())
+			{
+				break;
+			}
+			auto next = S.mQueue.end();
+			for (auto it = S.mQueue.begin(); it != S.mQueue.end(); ++it)
+			{
+				if (!(*it)->mWaiting && (next == S.mQueue.end() || (*it)->mPass < (*next)->mPass))
+				{
+					next = it;
+				}
+			}
+			if (next != S.mQueue.end())
+			{
+				e = *next;
+				S.mQueue.erase(next);
+				S.mClock = e->mPass;
+			}
+		}
+		if (e == nullptr)
+		{
+			Io().Reap(true);		// every engine is waiting for a read
+			continue;
+		}
+		Io().Reap(false);
+
+		long long before = e->mInferences;
+		bool more;
+		{
+			std::lock_guard<std::recursive_mutex> machine(gMachineLock);
+			more = Resume(e, S.mSlice);
+		}
+		e->mPass += (double)(e->mInferences - before) / e->mWeight;
+
+		if (more)
+		{
+			std::lock_guard<std::mutex> lock(S.mLock);
+			S.mQueue.push_back(e);
+		}
+		else
+		{
+			delete e;
+		}
+	}
+}
+
+/*
+A query server. Programs that embed the engine usually want to ask it things from another process, so Serve() listens on a local socket and
+answers queries sent over it. Terms travel in a compact binary form rather than as text - there is no parser here to read text with anyway.
+Encode() writes a term as a tag byte followed by either a variable number ( variables are numbered in order of appearance, so a variable that
+occurs twice in a term is the same variable when it is read back ) or an arity, a name and the arguments. Integers are in host byte order:
+the server only listens on this machine.
+*/
+
+std::set<std::string>	gNames;
+std::mutex				gNamesLock;
+
+char* Intern(const std::string& Name)
+{
+	std::lock_guard<std::mutex> lock(gNamesLock);
+	return (char*)gNames.insert(Name).first->c_str();
+}
+
+void Encode(Term* t, std::string& Out, std::map<Term*, uint32_t>& Vars)
+{
+	t = Deref(t);
+	if (t->mType == eVariable)
+	{
+		uint32_t n = Vars.emplace(t, (uint32_t)Vars.size()).first->second;
+		Out += 'V';
+		Out.append((char*)&n, sizeof(n));
+		return;
+	}
+
+	uint8_t arity = (uint8_t)t->mAtom.mArity;
+	uint16_t length = (uint16_t)strlen(t->mAtom.mName);
+	Out += 'A';
+	Out.append((char*)&arity, sizeof(arity));
+	Out.append((char*)&length, sizeof(length));
+	Out.append(t->mAtom.mName, length);
+	for (int i = 0; i < arity; i++)
+	{
+		Encode(t->mAtom.mTerms[i], Out, Vars);
+	}
+}
+
+/*
+Decode() reads one term back, making fresh variables, and returns nullptr if the bytes run out or don't describe a term. It recurses once
+per level of nesting, and a message can hold millions of levels, so a term nested deeper than gDecodeDepth - a list longer than that, say -
+is refused rather than allowed to run the thread out of stack.
+*/
+
+const int	gDecodeDepth = 10000;
+
+Term* Decode(const char*& In, const char* End, std::vector<Term*>& Vars, int Depth = 0)
+{
+	if (In >= End || Depth > gDecodeDepth)
+	{
+		return nullptr;
+	}
+
+	char tag = *In++;
+	if (tag == 'V')
+	{
+		uint32_t n;
+		if (End - In < (long)sizeof(n))
+		{
+			return nullptr;
+		}
+		memcpy(&n, In, sizeof(n));
+		In += sizeof(n);
+		if (n > Vars.size())
+		{
+			return nullptr;
+		}
+		if (n == Vars.size())
+		{
+			Vars.push_back(mkVar());
+		}
+		return Vars[n];
+	}
+
+	uint8_t arity;
+	uint16_t length;
+	if (tag != 'A' || End - In < (long)(sizeof(arity) + sizeof(length)))
+	{
+		return nullptr;
+	}
+	memcpy(&arity, In, sizeof(arity));
+	memcpy(&length, In + sizeof(arity), sizeof(length));
+	In += sizeof(arity) + sizeof(length);
+	if (arity > 10 || End - In < length)
+	{
+		return nullptr;
+	}
+
+	Term* a = new Term();
+	a->mType = eAtom;
+	a->mAtom.mName = Intern(std::string(In, length));
+	a->mAtom.mArity = arity;
+	In += length;
+	for (int i = 0; i < arity; i++)
+	{
+		a->mAtom.mTerms[i] = Decode(In, End, Vars, Depth + 1);
+		if (a->mAtom.mTerms[i] == nullptr)
+		{
+			return nullptr;
+		}
+	}
+	return a;
+}
+
+/*
+Each message is framed with its length, a kind and the id of the query it belongs to, so a client can send a whole batch of queries without
+waiting - pipelining - and still tell which answers are whose. A query is answered with any number of answer messages, each the query with
+its variables bound, and then a done message; a query that can't be decoded gets an error message instead.
+*/
+
+enum Message
+{
+	eMessageQuery = 'Q',
+	eMessageAnswer = 'A',
+	eMessageDone = 'D',
+	eMessageError = 'E',
+	eMessageRequest = 'R',		// a query preceded by its Policy, see below
+	eMessageShed = 'S',
+	eMessageAssert = 'F',		// see Place()
+	eMessageRetract = 'X',
+	eMessageWork = 'W',			// see Distribute()
+	eMessageSteal = 'T',
+	eMessageCancel = 'C'
+};
+
+const size_t	gHeader = sizeof(uint32_t) + 1 + sizeof(uint32_t);
+const uint32_t	gLargestMessage = 16 << 20;
+
+void Frame(std::string& Out, Message Kind, uint32_t Id, Term* t)
+{
+	size_t start = Out.size();
+	Out.append(gHeader, '\0');
+	if (t != nullptr)
+	{
+		std::map<Term*, uint32_t> vars;
+		Encode(t, Out, vars);
+	}
+	uint32_t length = (uint32_t)(Out.size() - start - gHeader);
+	memcpy(&Out[start], &length, sizeof(length));
+	Out[start + sizeof(length)] = (char)Kind;
+	memcpy(&Out[start + sizeof(length) + 1], &Id, sizeof(Id));
+}
+
+/*
+Unframe() takes the first whole message off the front of In, or returns false if there isn't one yet.
+*/
+
+bool Unframe(const std::string& In, size_t& Offset, Message& Kind, uint32_t& Id, const char*& Body, uint32_t& Length)
+{
+	if (In.size() - Offset < gHeader)
+	{
+		return false;
+	}
+	memcpy(&Length, &In[Offset], sizeof(Length));
+	if (In.size() - Offset - gHeader < Length)
+	{
+		return false;
+	}
+	Kind = (Message)In[Offset + sizeof(Length)];
+	memcpy(&Id, &In[Offset + sizeof(Length) + 1], sizeof(Id));
+	Body = &In[Offset + gHeader];
+	Offset += gHeader + Length;
+	return true;
+}
+
+/*
+An Address is either the path of a Unix socket, or a TCP port number on the loopback interface.
+*/
+
+int Socket(const char* Address, bool Listening)
+{
+	int s;
+	int result;
+	if (Address[0] == '/')
+	{
+		sockaddr_un un = {};
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, Address, sizeof(un.sun_path) - 1);
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (Listening)
+		{
+			unlink(Address);
+			result = bind(s, (sockaddr*)&un, sizeof(un));
+		}
+		else
+		{
+			result = connect(s, (sockaddr*)&un, sizeof(un));
+		}
+	}
+	else
+	{
+		sockaddr_in in = {};
+		in.sin_family = AF_INET;
+		in.sin_port = htons((uint16_t)atoi(Address));
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		s = socket(AF_INET, SOCK_STREAM, 0);
+		int on = 1;
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		result = Listening ? bind(s, (sockaddr*)&in, sizeof(in)) : connect(s, (sockaddr*)&in, sizeof(in));
+	}
+
+	if (s < 0 || result < 0 || (Listening && listen(s, 128) < 0))
+	{
+		if (s >= 0)
+		{
+			close(s);
+		}
+		return -1;
+	}
+	return s;
+}
+
+/*
+The server is a single thread running an epoll loop. Every connection is a Session, and every query on it becomes a Job with its own
+Engine. Between waits for the network the loop runs jobs a slice of inferences at a time, so a connection running a long query holds up
+nobody else. The engines all belong to the server thread, which is the only one that ever resumes them.
+
+A client may shut down its side of the connection as soon as it has sent its queries. That only ends what it sends: the queries already
+received are still run and answered, and the session is closed once they have been and the answers have gone.
+
+A client that sends queries faster than it reads the answers would otherwise have the server buffer answers without limit. So once a
+session has more than gHighWater bytes waiting to be sent, its engines stop at their next answer - Yield() doesn't care why it was called -
+and aren't resumed, and the server stops reading that connection, until the client has caught up. The kernel's own buffers then push back
+on the client in turn.
+*/
+
+const size_t	gHighWater = 256 << 10;
+
+struct Job;
+
+struct Session
+{
+	int				mSocket;
+	std::string		mIn;
+	size_t			mRead;
+	std::string		mOut;
+	size_t			mSent;
+	int				mJobs;
+	bool			mClosed;
+	bool			mEnded;			// the client has shut down its side
+	uint32_t		mEvents;
+	std::deque<Job*>	mHeld;		// behind an update, see Dispatch()
+
+	size_t Unsent() const { return mOut.size() - mSent; }
+};
+
+/*
+Admission control. When a burst of expensive queries arrives, running all of them at once slows every one of them down together - including
+the cheap ones that would have been answered in a single slice. So a query may be sent with a Policy: a priority, the tenant it is run on
+behalf of, a deadline, and budgets for inferences and memory. A query sent without one gets gDefaultPolicy.
+
+Each tenant may only have gTenantLimit jobs running at once. The rest wait, highest priority first and then in order of arrival, and a job
+that is still waiting when its deadline passes is shed - answered with a shed message rather than run late. So is every query that arrives
+to find gQueueLimit jobs already waiting. Running jobs share the loop by stride scheduling, as in the Scheduler, with a weight of 4 to the
+power of their priority. A new job starts level with the server's clock, so a cheap query runs at once however many long ones are active.
+
+A job that has used more than gDemoteAfter inferences is evidently not cheap, and is demoted to the lowest weight so that it stops
+competing with those that are. A job that overruns its inference or memory budget, or its deadline, is cancelled and shed. An engine's
+memory here is its stack, which is where this machine keeps the state of a search, plus its trail, plus the terms it has made and not freed
+- all three are measured every time it yields. The terms come from the thread's Arena, which engines on a thread share, so each engine keeps
+its own count of the bytes taken from it and given back, swapped in and out with the rest of its state. A term made by one engine and freed
+by another is credited to the second, so the count is clamped at zero. Atom names, the text of stream chunks and any closure that
+std::function puts on the heap are not terms, and are not counted.
+*/
+
+struct Policy
+{
+	uint8_t		mPriority;			// 0 to 3, higher runs first
+	uint32_t	mTenant;
+	uint32_t	mDeadline;			// milliseconds after arrival, 0 for none
+	uint64_t	mInferences;		// 0 for no limit
+	uint64_t	mBytes;				// 0 for no limit
+};
+
+typedef std::chrono::steady_clock	Clock;
+
+const Policy	gDefaultPolicy = { 1, 0, 0, 0, 0 };
+const int		gPriorities = 4;
+const int		gTenantLimit = 8;
+const size_t	gQueueLimit = 4096;
+const long long	gDemoteAfter = 100000;
+
+struct Job
+{
+	Session*			mSession;
+	uint32_t			mId;
+	Term*				mQuery;
+	Policy				mPolicy;
+	Clock::time_point	mDeadline;
+	Engine*				mEngine;
+	double				mPass;
+	bool				mShed;
+	Message				mKind;		// a query, or an update to a shard's facts
+};
+
+struct Server
+{
+	std::deque<Job*>			mWaiting[gPriorities];
+	size_t						mQueued;
+	std::vector<Job*>			mRunning;
+	std::map<uint32_t, int>		mTenants;
+	double						mClock;
+	long long					mSlice;
+};
+
+/*
+Request() frames a query together with its Policy. The Policy is written a field at a time, like a term, rather than as the struct - whose
+padding would go out as whatever bytes happened to be there, and whose layout is the compiler's business.
+*/
+
+void Pack(std::string& Out, const Policy& P)
+{
+	Out.append((const char*)&P.mPriority, sizeof(P.mPriority));
+	Out.append((const char*)&P.mTenant, sizeof(P.mTenant));
+	Out.append((const char*)&P.mDeadline, sizeof(P.mDeadline));
+	Out.append((const char*)&P.mInferences, sizeof(P.mInferences));
+	Out.append((const char*)&P.mBytes, sizeof(P.mBytes));
+}
+
+const size_t	gPolicyBytes = sizeof(uint8_t) + 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+
+bool Unpack(const char*& In, const char* End, Policy& P)
+{
+	if (End - In < (long)gPolicyBytes)
+	{
+		return false;
+	}
+	memcpy(&P.mPriority, In, sizeof(P.mPriority));
+	In += sizeof(P.mPriority);
+	memcpy(&P.mTenant, In, sizeof(P.mTenant));
+	In += sizeof(P.mTenant);
+	memcpy(&P.mDeadline, In, sizeof(P.mDeadline));
+	In += sizeof(P.mDeadline);
+	memcpy(&P.mInferences, In, sizeof(P.mInferences));
+	In += sizeof(P.mInferences);
+	memcpy(&P.mBytes, In, sizeof(P.mBytes));
+	In += sizeof(P.mBytes);
+	return true;
+}
+
+void Request(std::string& Out, uint32_t Id, Term* t, const Policy& P)
+{
+	size_t start = Out.size();
+	Frame(Out, eMessageRequest, Id, t);
+	std::string policy;
+	Pack(policy, P);
+	Out.insert(start + gHeader, policy);
+	uint32_t length = (uint32_t)(Out.size() - start - gHeader);
+	memcpy(&Out[start], &length, sizeof(length));
+}
+
+size_t Memory(Engine* E)
+{
+	return E->mStackUsed + E->mTrail.capacity() * sizeof(Trail::Entry) + std::max(E->mTermBytes, 0LL);
+}
+
+void Finish(Job* J, Message Kind)
+{
+	Frame(J->mSession->mOut, Kind, J->mId, nullptr);
+	J->mSession->mJobs--;
+	delete J;
+}
+
+void Admit(Server& S, Job* J)
+{
+	if (S.mQueued >= gQueueLimit)
+	{
+		Finish(J, eMessageShed);
+		return;
+	}
+	S.mWaiting[J->mPolicy.mPriority].push_back(J);
+	S.mQueued++;
+}
+
+/*
+Launch() moves as many waiting jobs as their tenants' limits allow into the running set, shedding any whose deadline has already gone.
+*/
+
+void Launch(Server& S)
+{
+	Clock::time_point now = Clock::now();
+	for (int p = gPriorities - 1; p >= 0; p--)
+	{
+		std::deque<Job*>& waiting = S.mWaiting[p];
+		for (size_t i = 0; i < waiting.size();)
+		{
+			Job* j = waiting[i];
+			bool late = j->mPolicy.mDeadline != 0 && now > j->mDeadline;
+			if (!late && (j->mSession->mClosed || S.mTenants[j->mPolicy.mTenant] >= gTenantLimit))
+			{
+				i++;
+				continue;
+			}
+
+			waiting.erase(waiting.begin() + i);
+			S.mQueued--;
+			if (late || j->mSession->mClosed)
+			{
+				Finish(j, eMessageShed);
+				continue;
+			}
+
+			Session* session = j->mSession;
+			long long limit = j->mPolicy.mInferences == 0 ? LLONG_MAX : (long long)j->mPolicy.mInferences;
+			j->mEngine = mkEngine(j->mQuery, [session, j](Term* Answer) {
+				Frame(session->mOut, eMessageAnswer, j->mId, Answer);
+				if (session->Unsent() > gHighWater)
+				{
+					Yield();
+				}
+			}, 1, limit);
+			j->mPass = S.mClock;
+			S.mTenants[j->mPolicy.mTenant]++;
+			S.mRunning.push_back(j);
+		}
+	}
+}
+
+bool Runnable(Job* J)
+{
+	return !J->mEngine->mWaiting && (J->mSession->Unsent() <= gHighWater || J->mSession->mClosed);
+}
+
+/*
+Step() runs one slice of the runnable job with the lowest pass, and reports whether there was one. A job that breaks its policy is cancelled
+and run on to the end straight away - which takes no inferences, as the search only has to unwind.
+*/
+
+bool Step(Server& S)
+{
+	Job* j = nullptr;
+	for (Job* r : S.mRunning)
+	{
+		if (Runnable(r) && (j == nullptr || r->mPass < j->mPass))
+		{
+			j = r;
+		}
+	}
+	if (j == nullptr)
+	{
+		return false;
+	}
+
+	S.mClock = j->mPass;
+	Engine* e = j->mEngine;
+	long long before = e->mInferences;
+	bool more;
+	{
+		std::lock_guard<std::recursive_mutex> machine(gMachineLock);
+		more = Resume(e, S.mSlice);
+	}
+
+	bool late = j->mPolicy.mDeadline != 0 && Clock::now() > j->mDeadline;
+	bool large = j->mPolicy.mBytes != 0 && Memory(e) > j->mPolicy.mBytes;
+	if (more && !j->mShed && (late || large || j->mSession->mClosed))
+	{
+		j->mShed = true;
+		Cancel(e);
+	}
+	int weight = e->mInferences > gDemoteAfter ? 1 : 1 << (2 * j->mPolicy.mPriority);
+	j->mPass += (double)(e->mInferences - before) / weight;
+
+	if (!more)
+	{
+		bool overrun = e->mInferences > e->mLimit;
+		bool incomplete = e->mShardsLost > 0;
+		S.mTenants[j->mPolicy.mTenant]--;
+		S.mRunning.erase(std::find(S.mRunning.begin(), S.mRunning.end(), j));
+		delete e;
+		Finish(j, j->mShed || overrun ? eMessageShed : incomplete ? eMessageError : eMessageDone);
+	}
+	return true;
+}
+
+void Flush(Session* S)
+{
+	while (S->Unsent() > 0)
+	{
+		ssize_t n = send(S->mSocket, S->mOut.data() + S->mSent, S->Unsent(), MSG_NOSIGNAL);
+		if (n <= 0)
+		{
+			S->mClosed = S->mClosed || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+			break;
+		}
+		S->mSent += n;
+	}
+	if (S->mSent == S->mOut.size())
+	{
+		S->mOut.clear();
+		S->mSent = 0;
+	}
+	else if (S->mSent > gHighWater)
+	{
+		S->mOut.erase(0, S->mSent);
+		S->mSent = 0;
+	}
+}
+
+/*
+Only a shard takes updates over the wire - any other server's program belongs to the process it runs in. A shard applies them in the order
+they arrive among the queries on the same connection: an update waits until the queries sent before it have finished, and the queries sent
+after it wait, in mHeld, until it has been applied. So a client that asserts a fact and then asks for it gets it back.
+*/
+
+bool	gShardMode = false;		// set in a shard, see Shard()
+
+void Apply(Job* J)
+{
+	if (J->mKind == eMessageAssert)
+	{
+		Assert(J->mQuery);
+	}
+	else if (Retract(J->mQuery))
+	{
+		Frame(J->mSession->mOut, eMessageAnswer, J->mId, J->mQuery);
+	}
+	Frame(J->mSession->mOut, eMessageDone, J->mId, nullptr);
+	delete J;
+}
+
+void Dispatch(Server& Srv, Session* S)
+{
+	while (!S->mHeld.empty())
+	{
+		Job* j = S->mHeld.front();
+		bool update = j->mKind == eMessageAssert || j->mKind == eMessageRetract;
+		if (update && S->mJobs > 0)
+		{
+			break;
+		}
+		S->mHeld.pop_front();
+		if (update)
+		{
+			Apply(j);
+		}
+		else
+		{
+			S->mJobs++;
+			Admit(Srv, j);
+		}
+	}
+}
+
+void Receive(Server& Srv, Session* S)
+{
+	char buffer[64 << 10];
+	for (;;)
+	{
+		ssize_t n = recv(S->mSocket, buffer, sizeof(buffer), 0);
+		if (n > 0)
+		{
+			S->mIn.append(buffer, n);
+			continue;
+		}
+		if (n == 0)
+		{
+			S->mEnded = true;
+		}
+		else
+		{
+			S->mClosed = S->mClosed || (errno != EAGAIN && errno != EWOULDBLOCK);
+		}
+		break;
+	}
+
+	Message kind;
+	uint32_t id;
+	uint32_t length;
+	const char* body;
+	while (!S->mClosed && Unframe(S->mIn, S->mRead, kind, id, body, length))
+	{
+		Policy policy = gDefaultPolicy;
+		const char* in = body;
+		if (kind == eMessageRequest)
+		{
+			Unpack(in, body + length, policy);
+		}
+
+		std::vector<Term*> vars;
+		bool update = kind == eMessageAssert || kind == eMessageRetract;
+		bool query = update || kind == eMessageQuery || (kind == eMessageRequest && in != body);
+		Term* goal = query ? Decode(in, body + length, vars) : nullptr;
+		if (goal == nullptr || goal->mType != eAtom || in != body + length || policy.mPriority >= gPriorities)
+		{
+			Frame(S->mOut, eMessageError, id, nullptr);
+			continue;
+		}
+		if (update && !gShardMode)
+		{
+			Frame(S->mOut, eMessageError, id, nullptr);
+			continue;
+		}
+
+		Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(policy.mDeadline);
+		S->mHeld.push_back(new Job{ S, id, goal, policy, deadline, nullptr, 0, false, kind });
+	}
+	Dispatch(Srv, S);
+
+	if (S->mIn.size() - S->mRead >= gHeader)
+	{
+		uint32_t next;
+		memcpy(&next, &S->mIn[S->mRead], sizeof(next));
+		S->mClosed = S->mClosed || next > gLargestMessage;
+	}
+	S->mIn.erase(0, S->mRead);
+	S->mRead = 0;
+}
+
+void Watch(int Poll, Session* S)
+{
+	uint32_t events = (S->Unsent() > 0 ? (uint32_t)EPOLLOUT : 0) | (S->Unsent() <= gHighWater && !S->mEnded ? (uint32_t)EPOLLIN : 0);
+	if (events != S->mEvents)
+	{
+		epoll_event e = {};
+		e.events = events;
+		e.data.ptr = S;
+		epoll_ctl(Poll, EPOLL_CTL_MOD, S->mSocket, &e);
+		S->mEvents = events;
+	}
+}
+
+/*
+Serve() answers queries on a socket made by Socket( Address, true ) until Stop is set, and then closes it. Making the socket first means a
+client can connect as soon as Serve() has been started on another thread. Each turn of the loop runs a single slice before looking at the
+network again - an epoll_wait() that doesn't wait is far cheaper than a slice, and a query that has just arrived is never kept waiting for
+more than one. A closed session's jobs are shed as they come up, and the session itself goes once they have.
+*/
+
+void Serve(int Listener, std::atomic<bool>& Stop, long long Slice = 100)
+{
+	fcntl(Listener, F_SETFL, O_NONBLOCK);
+
+	int poll = epoll_create1(0);
+	epoll_event e = {};
+	e.events = EPOLLIN;
+	e.data.ptr = nullptr;
+	epoll_ctl(poll, EPOLL_CTL_ADD, Listener, &e);
+
+	Server server;
+	e.data.ptr = &server;		// reads finishing, see ReadBytes()
+	epoll_ctl(poll, EPOLL_CTL_ADD, Io().Descriptor(), &e);
+
+	server.mQueued = 0;
+	server.mClock = 0;
+	server.mSlice = Slice;
+	std::vector<Session*> sessions;
+	epoll_event events[64];
+	bool stopping = false;
+	while (!stopping || !sessions.empty())
+	{
+		stopping = stopping || Stop.load();
+		Launch(server);
+		bool busy = std::any_of(server.mRunning.begin(), server.mRunning.end(), Runnable);
+		int n = epoll_wait(poll, events, 64, busy ? 0 : stopping ? 0 : 50);
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == &server)
+			{
+				Io().Reap(false);
+				continue;
+			}
+			Session* s = (Session*)events[i].data.ptr;
+			if (s == nullptr)
+			{
+				int c;
+				while ((c = accept4(Listener, nullptr, nullptr, SOCK_NONBLOCK)) >= 0)
+				{
+					s = new Session{ c, "", 0, "", 0, 0, stopping, false, EPOLLIN, {} };
+					epoll_event e = {};
+					e.events = EPOLLIN;
+					e.data.ptr = s;
+					epoll_ctl(poll, EPOLL_CTL_ADD, c, &e);
+					sessions.push_back(s);
+				}
+				continue;
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			{
+				Receive(server, s);
+			}
+			if (events[i].events & EPOLLOUT)
+			{
+				Flush(s);
+			}
+		}
+
+		Launch(server);
+		Step(server);
+
+		for (Session* s : sessions)
+		{
+			Dispatch(server, s);
+			s->mClosed = s->mClosed || stopping;
+			Flush(s);
+			s->mClosed = s->mClosed || (s->mEnded && s->mJobs == 0 && s->mHeld.empty() && s->Unsent() == 0);
+			Watch(poll, s);
+		}
+
+		auto closed = std::partition(sessions.begin(), sessions.end(), [](Session* s) { return !s->mClosed || s->mJobs > 0 || !s->mHeld.empty(); });
+		for (auto it = closed; it != sessions.end(); ++it)
+		{
+			epoll_ctl(poll, EPOLL_CTL_DEL, (*it)->mSocket, nullptr);
+			close((*it)->mSocket);
+			delete *it;
+		}
+		sessions.erase(closed, sessions.end());
+	}
+
+	close(poll);
+	close(Listener);
+}
+
+/*
+Generate() is a load generator for benchmarking the server. It opens Connections connections, each on its own thread, and sends Queries
+queries down each, keeping up to Depth of them in flight at once. Build makes the query numbered i - it runs on the connection's thread, so
+it must make its own variables. Every query is sent with the same Policy. The latency of each query is the time from sending it to its done
+or shed message.
+*/
+
+struct Load
+{
+	long long			mQueries;
+	long long			mAnswers;
+	long long			mErrors;
+	long long			mShed;
+	double				mSeconds;
+	std::vector<double>	mLatencies;		// microseconds, sorted
+
+	double Percentile(double p) const { return mLatencies.empty() ? 0 : mLatencies[(size_t)(p * (mLatencies.size() - 1))]; }
+};
+
+Load Generate(const char* Address, int Connections, int Queries, int Depth, std::function<Term*(int)> Build, const Policy& P = gDefaultPolicy)
+{
+	Load load = { 0, 0, 0, 0, 0, {} };
+	std::mutex lock;
+	std::vector<std::thread> threads;
+	Clock::time_point start = Clock::now();
+
+	for (int c = 0; c < Connections; c++)
+	{
+		threads.emplace_back([&, c]() {
+			int s = Socket(Address, false);
+			if (s < 0)
+			{
+				return;
+			}
+
+			std::vector<Clock::time_point> sent(Queries);
+			std::vector<double> latencies;
+			long long answers = 0;
+			long long errors = 0;
+			long long shed = 0;
+			int next = 0;
+			int done = 0;
+			std::string in;
+			size_t read = 0;
+			char buffer[64 << 10];
+
+			while (done < Queries)
+			{
+				std::string out;
+				while (next < Queries && next - done < Depth)
+				{
+					sent[next] = Clock::now();
+					Request(out, (uint32_t)next, Build(c * Queries + next), P);
+					next++;
+				}
+				if (!out.empty() && send(s, out.data(), out.size(), MSG_NOSIGNAL) != (ssize_t)out.size())
+				{
+					break;
+				}
+
+				ssize_t n = recv(s, buffer, sizeof(buffer), 0);
+				if (n <= 0)
+				{
+					break;
+				}
+				in.append(buffer, n);
+
+				Message kind;
+				uint32_t id;
+				uint32_t length;
+				const char* body;
+				while (Unframe(in, read, kind, id, body, length))
+				{
+					if (kind == eMessageAnswer)
+					{
+						answers++;
+						continue;
+					}
+					errors += kind == eMessageError;
+					shed += kind == eMessageShed;
+					latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent[id]).count());
+					done++;
+				}
+				in.erase(0, read);
+				read = 0;
+			}
+			close(s);
+
+			std::lock_guard<std::mutex> guard(lock);
+			load.mQueries += done;
+			load.mAnswers += answers;
+			load.mErrors += errors;
+			load.mShed += shed;
+			load.mLatencies.insert(load.mLatencies.end(), latencies.begin(), latencies.end());
+		});
+	}
+
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	load.mSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+	std::sort(load.mLatencies.begin(), load.mLatencies.end());
+	return load;
+}
+
+/*
+A sharded fact store. A fact base too big for one process can be split across several: DeclareSharded() partitions a predicate's facts by
+the hash of one argument, and each partition lives in a separate server process - a shard. Assert() and Retract() send a fact to the one
+shard that owns it, and the shards answer the same protocol as any other server, so a shard is just Serve() with facts in it.
+
+	:- sharded city( +Country, _ ) on [ shard0, shard1, shard2 ].
+
+A call with the sharding argument bound can only be answered by one shard, so it is routed there. Any other call is scattered to every shard
+and the answers gathered as they arrive, from whichever shard sends one first. Either way the answers come back through the normal
+backtracking interface - each one is unified with the goal in turn, and the next is only read when the last is retried. Connections are kept
+in a pool and reused once a call has read everything sent to it; a call abandoned part way, by a cut say, closes its connections instead,
+and the shard sheds the rest of the query. A fact that can't be placed on its shard is reported by Assert().
+
+A shard that can't be reached, that drops its connection, or that sends nothing for gShardTimeout is taken to be dead, and its connection
+closed. The answers it would have sent are missing, so the call has not failed so much as not finished: once the others are done it is
+reported in gShardsLost, which counts the shards given up on by every sharded call made on the thread - or in the engine, as Switch() swaps
+it with the rest of an engine's state. A caller that needs to know the answers were complete clears it first and looks at it afterwards.
+The server does so for every query, and ends one that lost a shard with an error message instead of done, after the answers it did get.
+*/
+
+const int	gShardTimeout = 10000;		// milliseconds
+
+struct Shards
+{
+	int								mArgument;
+	std::vector<std::string>		mAddresses;
+	std::mutex						mLock;
+	std::vector<std::vector<int>>	mIdle;		// pooled connections, per shard
+};
+
+int Connect(Shards* S, size_t Shard)
+{
+	{
+		std::lock_guard<std::mutex> lock(S->mLock);
+		if (!S->mIdle[Shard].empty())
+		{
+			int c = S->mIdle[Shard].back();
+			S->mIdle[Shard].pop_back();
+			return c;
+		}
+	}
+	return Socket(S->mAddresses[Shard].c_str(), false);
+}
+
+void Release(Shards* S, size_t Shard, int Connection)
+{
+	std::lock_guard<std::mutex> lock(S->mLock);
+	S->mIdle[Shard].push_back(Connection);
+}
+
+size_t Owner(Shards* S, Term* Fact)
+{
+	return std::hash<std::string>()(Key(Fact->mAtom.mTerms[S->mArgument])) % S->mAddresses.size();
+}
+
+/*
+A Gather is one call's worth of answers on their way back from one or more shards. Next() returns the next answer from any of them, waiting
+for one if need be, or nullptr once every shard has said it is done or been given up on. mLost counts the shards given up on.
+*/
+
+struct Gather
+{
+	Shards*					mShards;
+	std::vector<size_t>		mShard;
+	std::vector<int>		mSockets;		// -1 once finished with
+	std::vector<std::string>	mIn;
+	std::deque<Term*>		mReady;
+	int						mLost;
+
+	Gather() : mShards(nullptr), mLost(0) {}
+
+	~Gather()
+	{
+		for (int s : mSockets)
+		{
+			if (s >= 0)
+			{
+				close(s);
+			}
+		}
+	}
+
+	void Send(size_t Shard, Message Kind, Term* Goal)
+	{
+		int s = Connect(mShards, Shard);
+		std::string out;
+		Frame(out, Kind, 0, Goal);
+		if (s >= 0 && send(s, out.data(), out.size(), MSG_NOSIGNAL) != (ssize_t)out.size())
+		{
+			close(s);
+			s = -1;
+		}
+		if (s < 0)
+		{
+			mLost++;
+		}
+		mShard.push_back(Shard);
+		mSockets.push_back(s);
+		mIn.push_back("");
+	}
+
+	Term* Next()
+	{
+		while (mReady.empty())
+		{
+			std::vector<pollfd> polls;
+			std::vector<size_t> which;
+			for (size_t i = 0; i < mSockets.size(); i++)
+			{
+				if (mSockets[i] >= 0)
+				{
+					polls.push_back({ mSockets[i], POLLIN, 0 });
+					which.push_back(i);
+				}
+			}
+			if (polls.empty())
+			{
+				return nullptr;
+			}
+			if (poll(polls.data(), polls.size(), gShardTimeout) <= 0)
+			{
+				for (size_t i : which)
+				{
+					close(mSockets[i]);
+					mSockets[i] = -1;
+					mLost++;
+				}
+				return nullptr;
+			}
+
+			for (size_t p = 0; p < polls.size(); p++)
+			{
+				if (polls[p].revents != 0)
+				{
+					Read(which[p]);
+				}
+			}
+		}
+
+		Term* t = mReady.front();
+		mReady.pop_front();
+		return t;
+	}
+
+	void Read(size_t i)
+	{
+		char buffer[64 << 10];
+		ssize_t n = recv(mSockets[i], buffer, sizeof(buffer), 0);
+		if (n <= 0)
+		{
+			close(mSockets[i]);
+			mSockets[i] = -1;
+			mLost++;
+			return;
+		}
+		mIn[i].append(buffer, n);
+
+		Message kind;
+		uint32_t id;
+		uint32_t length;
+		const char* body;
+		size_t read = 0;
+		while (mSockets[i] >= 0 && Unframe(mIn[i], read, kind, id, body, length))
+		{
+			if (kind == eMessageAnswer)
+			{
+				std::vector<Term*> vars;
+				const char* in = body;
+				Term* t = Decode(in, body + length, vars);
+				if (t != nullptr)
+				{
+					mReady.push_back(t);
+				}
+				continue;
+			}
+			Release(mShards, mShard[i], mSockets[i]);
+			mSockets[i] = -1;
+		}
+		mIn[i].erase(0, read);
+	}
+};
+
+void Deliver(std::shared_ptr<Gather> G, Term* Goal, Continuation K, Retry R)
+{
+	Term* answer = G->Next();
+	if (answer == nullptr)
+	{
+		gShardsLost += G->mLost;
+		R();
+		return;
+	}
+
+	int index = gTrail.mTrail.size();
+	Unify(Goal, answer, K, [G, Goal, K, R, index]() {
+		gTrail.UnWind(index);
+		Deliver(G, Goal, K, R);
+	});
+}
+
+void ShardedCall(Predicate* P, Term* Goal, Continuation K, Retry R)
+{
+	Shards* s = P->mShards.get();
+	auto gather = std::make_shared<Gather>();
+	gather->mShards = s;
+	if (Ground(Goal->mAtom.mTerms[s->mArgument]))
+	{
+		gather->Send(Owner(s, Goal), eMessageQuery, Goal);
+	}
+	else
+	{
+		for (size_t i = 0; i < s->mAddresses.size(); i++)
+		{
+			gather->Send(i, eMessageQuery, Goal);
+		}
+	}
+	Deliver(gather, Goal, K, R);
+}
+
+/*
+Place() sends a fact to the shard that owns it, if its predicate is sharded, and waits for the shard to take it. A shard answers a retract
+with the fact if it had it. Present is whether the fact was added or removed - false when the shard couldn't be reached, or failed before
+saying it was done.
+*/
+
+bool Place(Term* Fact, bool Adding, bool& Present)
+{
+	auto it = gProgram.find(Functor(Fact));
+	if (it == gProgram.end() || it->second.mShards == nullptr)
+	{
+		return false;
+	}
+
+	Gather gather;
+	gather.mShards = it->second.mShards.get();
+	gather.Send(Owner(gather.mShards, Fact), Adding ? eMessageAssert : eMessageRetract, Fact);
+	bool answered = gather.Next() != nullptr;
+	Present = Adding ? gather.mLost == 0 : answered;
+	return true;
+}
+
+void DeclareSharded(const char* Name, int Argument, const std::vector<std::string>& Addresses)
+{
+	Predicate& p = gProgram[Name];
+	p.mShards = std::make_shared<Shards>();
+	p.mShards->mArgument = Argument;
+	p.mShards->mAddresses = Addresses;
+	p.mShards->mIdle.resize(Addresses.size());
+}
+
+/*
+Shard() starts a shard as a child process serving Address, and StopShard() shuts it down again. The socket is made before the fork, so the shard
+can be used straight away. The child starts with a copy of everything the parent had, but only ever sees the facts it is sent - so a
+predicate should be declared sharded after its shards are started. The parent mustn't have other threads running when it forks.
+*/
+
+pid_t Shard(const std::string& Address)
+{
+	int listener = Socket(Address.c_str(), true);
+	if (listener < 0)
+	{
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		gShardMode = true;
+		std::atomic<bool> never(false);
+		Serve(listener, never);
+		_exit(0);
+	}
+	close(listener);
+	return pid;
+}
+
+void StopShard(pid_t Shard, const std::string& Address)
+{
+	kill(Shard, SIGTERM);
+	waitpid(Shard, nullptr, 0);
+	unlink(Address.c_str());
+}
+
+/*
+Distributed OR-parallel search. A search tree's branches are independent of each other, so a big enough tree can be split across processes,
+and then across machines. The difficulty is that in this machine an unexplored branch is a Retry - a closure, which can't be sent anywhere.
+So Distribute() searches in a different way, with every choice point a term. A resolvent is the answer being built and the goals still to
+be proved:
+
+	state( Answer, [ Goal | Goals ] )
+
+Expand() takes one step: it resolves the first goal against each clause of its predicate in turn, and every clause whose head matches makes a
+new resolvent - a renamed copy of the state, with the goal replaced by the clause's body. A resolvent with no goals left is an answer. The
+resolvents waiting to be expanded are kept on a stack, and since each one is a plain term, any of them can be encoded and sent to another
+process to expand there instead. Only clauses and the builtins true, fail and = are understood. Anything else would change meaning here: a
+cut means nothing once the branches it would cut are spread over several processes, var() and nonvar() ask about bindings that a resolvent
+may not have yet, a sharded predicate's facts aren't in this process at all, and an external one isn't clauses. So Expandable() looks
+through everything the goals can call first, and a search that could reach any of them is refused rather than run with a different
+meaning. Tabled and memoised predicates are resolved against their clauses like any other, which finds the same answers.
+*/
+
+Term* List(std::vector<Term*>::iterator Begin, std::vector<Term*>::iterator End)
+{
+	Term* list = mkAtom("[]");
+	for (auto it = End; it != Begin; --it)
+	{
+		list = mkAtom(".", *(it - 1), list);
+	}
+	return list;
+}
+
+Term* Resolvent(Term* Answer, std::vector<Term*> Goals)
+{
+	std::map<Term*, Term*> fresh;
+	return Rename(mkAtom("state", Answer, List(Goals.begin(), Goals.end())), fresh);
+}
+
+bool Expandable(std::vector<Term*> Goals, std::set<std::string>& Visited)
+{
+	for (Term* g : Goals)
+	{
+		g = Deref(g);
+		const char* name = g->mAtom.mName;
+		if (g->mType != eAtom || strcmp(name, "!") == 0 || ((strcmp(name, "var") == 0 || strcmp(name, "nonvar") == 0) && g->mAtom.mArity == 1) ||
+			(strcmp(name, "read_bytes") == 0 && g->mAtom.mArity == 4) || ((strcmp(name, "file_lines") == 0 || strcmp(name, "file_line") == 0) && g->mAtom.mArity == 2))
+		{
+			return false;
+		}
+		if (strcmp(name, "true") == 0 || strcmp(name, "fail") == 0 || (strcmp(name, "=") == 0 && g->mAtom.mArity == 2))
+		{
+			continue;
+		}
+
+		std::string functor = Functor(g);
+		auto it = gProgram.find(functor);
+		if (it == gProgram.end() || !Visited.insert(functor).second)
+		{
+			continue;
+		}
+		if (it->second.mShards != nullptr || it->second.mExternal != nullptr)
+		{
+			return false;
+		}
+		for (Clause& c : it->second.mClauses)
+		{
+			if (!Expandable(c.mBody, Visited))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void Expand(Term* State, std::vector<Term*>& Stack, std::function<void(Term*)> Answer)
+{
+	Term* goals = Deref(State->mAtom.mTerms[1]);
+	if (goals->mAtom.mArity == 0)
+	{
+		Answer(State->mAtom.mTerms[0]);
+		return;
+	}
+
+	Term* goal = Deref(goals->mAtom.mTerms[0]);
+	Term* rest = goals->mAtom.mTerms[1];
+	int index = gTrail.mTrail.size();
+	auto push = [&Stack, State](Term* Goals) {
+		std::map<Term*, Term*> fresh;
+		Stack.push_back(Rename(mkAtom("state", State->mAtom.mTerms[0], Goals), fresh));
+	};
+
+	const char* name = goal->mAtom.mName;
+	if (strcmp(name, "true") == 0)
+	{
+		push(rest);
+	}
+	else if (strcmp(name, "=") == 0 && goal->mAtom.mArity == 2)
+	{
+		Unify(goal->mAtom.mTerms[0], goal->mAtom.mTerms[1], [&push, rest](Retry) { push(rest); }, []() {});
+	}
+	else
+	{
+		auto it = gProgram.find(Functor(goal));
+		size_t count = it == gProgram.end() ? 0 : it->second.mClauses.size();
+		for (size_t i = count; i > 0; i--)		// pushed last to first, so the first clause is expanded next
+		{
+			Clause& c = it->second.mClauses[i - 1];
+			std::map<Term*, Term*> fresh;
+			Term* head = Rename(c.mHead, fresh);
+			Term* body = rest;
+			for (size_t j = c.mBody.size(); j > 0; j--)
+			{
+				body = mkAtom(".", Rename(c.mBody[j - 1], fresh), body);
+			}
+			Unify(head, goal, [&push, body](Retry) { push(body); }, []() {});
+			gTrail.UnWind(index);
+		}
+	}
+	gTrail.UnWind(index);
+}
+
+/*
+The processes are a coordinator - the caller of Distribute() - and a number of workers forked from it, each connected to it by a socket pair
+and each holding a copy of the program. A worker expands resolvents from the top of its own stack. When it runs out it tells the
+coordinator, which picks a busy worker and asks it, on the thief's behalf, for work; the victim gives up half of the resolvents at the bottom
+of its stack, the oldest and so the largest parts of the tree, and the coordinator passes them on. Stealing rather than handing out work up
+front means nobody needs to know in advance how the tree is shaped. Worker w is pinned to NUMA node w % Nodes(), and the coordinator looks
+for a victim on the thief's own node before any other, so stolen resolvents are copied between neighbours where it can.
+
+Because all the work passes through it, the coordinator knows when the search is over: every worker has said it is idle, and no request
+for work is still waiting on a victim's reply - so no resolvent can be anywhere in between. To cancel the search, when Result asks for no
+more answers, it tells every worker to drop its stack, and then waits for that same condition.
+
+A Link is one end of a socket pair, reading messages with the same framing as the server.
+*/
+
+struct Link
+{
+	int				mSocket;
+	std::string		mIn;
+	size_t			mRead;
+
+	void Send(Message Kind, uint32_t Id, Term* t)
+	{
+		std::string out;
+		Frame(out, Kind, Id, t);
+		for (size_t sent = 0; sent < out.size();)
+		{
+			ssize_t n = send(mSocket, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0)
+			{
+				return;
+			}
+			sent += n;
+		}
+	}
+
+	bool Next(Message& Kind, uint32_t& Id, Term*& t)
+	{
+		uint32_t length;
+		const char* body;
+		if (!Unframe(mIn, mRead, Kind, Id, body, length))
+		{
+			mIn.erase(0, mRead);
+			mRead = 0;
+			return false;
+		}
+		std::vector<Term*> vars;
+		t = length == 0 ? nullptr : Decode(body, body + length, vars);
+		return true;
+	}
+
+	bool Fill()
+	{
+		char buffer[64 << 10];
+		ssize_t n = recv(mSocket, buffer, sizeof(buffer), 0);
+		if (n <= 0)
+		{
+			return false;
+		}
+		mIn.append(buffer, n);
+		return true;
+	}
+};
+
+/*
+Explore() is a worker's whole life. It looks at its socket every gPollEvery expansions, and waits on it whenever its stack is empty; it goes once
+the coordinator closes the other end.
+*/
+
+const int	gPollEvery = 64;
+const int	gStealMost = 64;
+
+void Explore(int Socket)
+{
+	Link link = { Socket, "", 0 };
+	std::vector<Term*> stack;
+	bool idle = true;
+	for (long long step = 0;; step++)
+	{
+		if (stack.empty() && !idle)
+		{
+			link.Send(eMessageDone, 0, nullptr);
+			idle = true;
+		}
+
+		pollfd p = { Socket, POLLIN, 0 };
+		if ((stack.empty() || step % gPollEvery == 0) && poll(&p, 1, stack.empty() ? -1 : 0) > 0)
+		{
+			if (!link.Fill())
+			{
+				return;
+			}
+			Message kind;
+			uint32_t id;
+			Term* t;
+			while (link.Next(kind, id, t))
+			{
+				if (kind == eMessageWork)
+				{
+					for (t = Deref(t); t->mAtom.mArity == 2; t = Deref(t->mAtom.mTerms[1]))
+					{
+						stack.push_back(t->mAtom.mTerms[0]);
+					}
+					idle = stack.empty();
+				}
+				else if (kind == eMessageSteal)
+				{
+					size_t give = std::min(stack.size() - stack.size() / 2, (size_t)gStealMost);
+					link.Send(eMessageWork, id, List(stack.begin(), stack.begin() + give));
+					stack.erase(stack.begin(), stack.begin() + give);
+				}
+				else if (kind == eMessageCancel)
+				{
+					stack.clear();
+				}
+			}
+			continue;
+		}
+
+		if (!stack.empty())
+		{
+			Term* state = stack.back();
+			stack.pop_back();
+			Expand(state, stack, [&link](Term* Answer) { link.Send(eMessageAnswer, 0, Answer); });
+		}
+	}
+}
+
+/*
+Distribute() searches for Answer such that Goals are all true, over Workers processes, and passes each answer to Result - in no particular
+order - until Result returns false or the search is over. It returns the number of answers passed on, or -1 without searching at all if the
+goals aren't Expandable(). As with Shard(), the caller mustn't have other threads running when it forks.
+*/
+
+long long Distribute(Term* Answer, std::vector<Term*> Goals, int Workers, std::function<bool(Term*)> Result)
+{
+	std::set<std::string> visited;
+	if (!Expandable(Goals, visited))
+	{
+		return -1;
+	}
+
+	std::vector<Link> links;
+	std::vector<pid_t> pids;
+	for (int w = 0; w < Workers; w++)
+	{
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+		{
+			break;
+		}
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			for (Link& l : links)
+			{
+				close(l.mSocket);
+			}
+			close(pair[0]);
+			Explore(pair[1]);
+			_exit(0);
+		}
+		if (Nodes() > 1)
+		{
+			PinToNode(w % Nodes(), pid);		// from here, so gUnpinned counts it in this process
+		}
+		close(pair[1]);
+		links.push_back({ pair[0], "", 0 });
+		pids.push_back(pid);
+	}
+
+	int n = (int)links.size();
+	std::vector<bool> idle(n, true);
+	std::vector<int> victimOf(n, -1);		// the worker asked for work on each idle worker's behalf
+	std::vector<bool> asked(n, false);		// whether each worker has a steal request to answer
+	long long answers = 0;
+	bool cancelled = false;
+
+	if (n > 0)
+	{
+		links[0].Send(eMessageWork, 0, mkAtom(".", Resolvent(Answer, Goals), mkAtom("[]")));
+		idle[0] = false;
+	}
+
+	for (int next = 0;;)
+	{
+		bool busy = false;
+		bool waiting = false;
+		for (int w = 0; w < n; w++)
+		{
+			busy = busy || !idle[w];
+			waiting = waiting || asked[w];
+		}
+		if (!busy && !waiting)
+		{
+			break;
+		}
+
+		for (int w = 0; w < n && !cancelled; w++)
+		{
+			if (!idle[w] || victimOf[w] >= 0)
+			{
+				continue;
+			}
+			for (int i = 0; i < 2 * n && victimOf[w] < 0; i++)
+			{
+				int v = (next + i) % n;
+				if (!idle[v] && !asked[v] && (i >= n || v % Nodes() == w % Nodes()))
+				{
+					links[v].Send(eMessageSteal, (uint32_t)w, nullptr);
+					asked[v] = true;
+					victimOf[w] = v;
+					next = v + 1;
+				}
+			}
+		}
+
+		std::vector<pollfd> polls;
+		for (Link& l : links)
+		{
+			polls.push_back({ l.mSocket, POLLIN, 0 });
+		}
+		poll(polls.data(), polls.size(), -1);
+		for (int w = 0; w < n; w++)
+		{
+			if (polls[w].revents == 0)
+			{
+				continue;
+			}
+			if (!links[w].Fill())
+			{
+				idle[w] = true;
+				asked[w] = false;
+				continue;
+			}
+
+			Message kind;
+			uint32_t id;
+			Term* t;
+			while (links[w].Next(kind, id, t))
+			{
+				if (kind == eMessageAnswer && !cancelled)
+				{
+					answers++;
+					if (!Result(t))
+					{
+						cancelled = true;
+						for (Link& l : links)
+						{
+							l.Send(eMessageCancel, 0, nullptr);
+						}
+					}
+				}
+				else if (kind == eMessageDone)
+				{
+					idle[w] = true;
+				}
+				else if (kind == eMessageWork)
+				{
+					asked[w] = false;
+					victimOf[id] = -1;
+					if (t != nullptr && Deref(t)->mAtom.mArity == 2 && !cancelled)
+					{
+						links[id].Send(eMessageWork, 0, t);
+						idle[id] = false;
+					}
+				}
+			}
+		}
+	}
+
+	for (int w = 0; w < n; w++)
+	{
+		close(links[w].mSocket);
+		waitpid(pids[w], nullptr, 0);
+	}
+	return answers;
+}
+
+/*
+Checkpoints. An exhaustive enumeration can run for days, and a crash or a restart shouldn't throw all of that away. A paused Engine can't be
+saved - it is a stack full of closures and return addresses that only mean anything in the process that made them. But the resolvents
+Distribute() works with can: they hold the whole state of a search as terms. The stack of waiting resolvents is the choice points, the one on
+top is the goals still to prove - the continuation - and the terms they reach are the heap. There is no trail to save, as each resolvent is
+a renamed copy with no bindings into any other.
+
+A Search runs that way in a single process, in the same order as Solve() - the first clause's resolvent is always on top. It understands no
+more than Distribute() does, so Begin() refuses goals that aren't Expandable() - a cut, above all, as the order a search runs in is exactly
+what a cut would change. Continue()
+expands resolvents until it has taken Steps steps, Result asks it to pause, or there is nothing left. Checkpoint() saves a search to a file
+and Restore() loads it back, in this process or a new one, to carry on exactly where it stopped: the next answer is the one that would have
+come next. The program itself isn't saved, and the process that restores must load the same one - a fingerprint of the clauses is saved
+alongside, and Restore() refuses a checkpoint made against any other.
+*/
+
+struct Search
+{
+	std::vector<Term*>	mStack;
+	long long			mAnswers;
+	long long			mSteps;
+};
+
+bool Begin(Search& S, Term* Answer, std::vector<Term*> Goals)
+{
+	std::set<std::string> visited;
+	if (!Expandable(Goals, visited))
+	{
+		return false;
+	}
+	S = { { Resolvent(Answer, Goals) }, 0, 0 };
+	return true;
+}
+
+bool Continue(Search& S, long long Steps, std::function<bool(Term*)> Result)
+{
+	bool more = true;
+	for (long long i = 0; i < Steps && more && !S.mStack.empty(); i++)
+	{
+		Term* state = S.mStack.back();
+		S.mStack.pop_back();
+		S.mSteps++;
+		Expand(state, S.mStack, [&S, &more, &Result](Term* Answer) {
+			S.mAnswers++;
+			more = Result(Answer);
+		});
+	}
+	return !S.mStack.empty();
+}
+
+uint64_t Fingerprint()
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (auto& p : gProgram)
+	{
+		for (Clause& c : p.second.mClauses)
+		{
+			std::map<Term*, int> vars;
+			std::string clause = Variant(c.mHead, vars);
+			for (Term* g : c.mBody)
+			{
+				clause += ":" + Variant(g, vars);
+			}
+			for (char ch : clause + ".")
+			{
+				hash = (hash ^ (unsigned char)ch) * 1099511628211ULL;
+			}
+		}
+	}
+	return hash;
+}
+
+/*
+The file is a header - a magic number, the fingerprint and the counts - and then each resolvent in turn, bottom of the stack first, as a
+length and its encoding. It is written beside the old one and renamed over it, so a crash part way through leaves the last checkpoint whole.
+A rename is only as durable as the data under it, though: the new file is synced before it is renamed, so the name can never end up on a
+file whose contents didn't reach the disk, and the directory is synced after, so the rename itself has.
+*/
+
+const uint32_t	gCheckpointMagic = 0x4b434c50;		// "PLCK"
+
+bool Checkpoint(const Search& S, const char* File)
+{
+	std::string out;
+	uint64_t fingerprint = Fingerprint();
+	uint64_t count = S.mStack.size();
+	out.append((const char*)&gCheckpointMagic, sizeof(gCheckpointMagic));
+	out.append((const char*)&fingerprint, sizeof(fingerprint));
+	out.append((const char*)&S.mAnswers, sizeof(S.mAnswers));
+	out.append((const char*)&S.mSteps, sizeof(S.mSteps));
+	out.append((const char*)&count, sizeof(count));
+	for (Term* t : S.mStack)
+	{
+		std::string term;
+		std::map<Term*, uint32_t> vars;
+		Encode(t, term, vars);
+		uint32_t length = (uint32_t)term.size();
+		out.append((const char*)&length, sizeof(length));
+		out += term;
+	}
+
+	std::string temporary = std::string(File) + ".new";
+	int f = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f < 0)
+	{
+		return false;
+	}
+	size_t written = 0;
+	while (written < out.size())
+	{
+		ssize_t n = write(f, out.data() + written, out.size() - written);
+		if (n <= 0)
+		{
+			break;
+		}
+		written += n;
+	}
+	bool synced = written == out.size() && fsync(f) == 0;
+	if (close(f) != 0 || !synced || rename(temporary.c_str(), File) != 0)
+	{
+		unlink(temporary.c_str());
+		return false;
+	}
+
+	const char* slash = strrchr(File, '/');
+	std::string directory = slash == nullptr ? "." : slash == File ? "/" : std::string(File, slash - File);
+	int d = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+	if (d < 0)
+	{
+		return false;
+	}
+	synced = fsync(d) == 0;
+	close(d);
+	return synced;
+}
+
+bool Restore(Search& S, const char* File)
+{
+	std::ifstream file(File, std::ios::binary);
+	std::string in((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	const char* p = in.data();
+	const char* end = p + in.size();
+
+	uint32_t magic;
+	uint64_t fingerprint;
+	uint64_t count;
+	Search s;
+	if (end - p < (long)(sizeof(magic) + sizeof(fingerprint) + sizeof(s.mAnswers) + sizeof(s.mSteps) + sizeof(count)))
+	{
+		return false;
+	}
+	memcpy(&magic, p, sizeof(magic));
+	p += sizeof(magic);
+	memcpy(&fingerprint, p, sizeof(fingerprint));
+	p += sizeof(fingerprint);
+	memcpy(&s.mAnswers, p, sizeof(s.mAnswers));
+	p += sizeof(s.mAnswers);
+	memcpy(&s.mSteps, p, sizeof(s.mSteps));
+	p += sizeof(s.mSteps);
+	memcpy(&count, p, sizeof(count));
+	p += sizeof(count);
+	if (magic != gCheckpointMagic || fingerprint != Fingerprint())
+	{
+		return false;
+	}
+
+	for (uint64_t i = 0; i < count; i++)
+	{
+		uint32_t length;
+		if (end - p < (long)sizeof(length))
+		{
+			return false;
+		}
+		memcpy(&length, p, sizeof(length));
+		p += sizeof(length);
+		std::vector<Term*> vars;
+		const char* term = p;
+		Term* t = end - p < length ? nullptr : Decode(term, p + length, vars);
+		if (t == nullptr || term != p + length)
+		{
+			return false;
+		}
+		s.mStack.push_back(t);
+		p += length;
+	}
+
+	S = s;
+	return true;
+}
+
+/*
+Out of core fact tables. Some relations are bigger than memory, and can't be asserted at all. WriteTable() stores one as a file instead, and
+DeclareExternal() makes a predicate read its facts from there, a block at a time, as they are needed.
+
+The rows are sorted on their encoded values, first argument first, and cut into blocks of gBlockRows. Within a block each argument is stored
+as its own column, as runs of equal values - sorting puts equal first arguments side by side, and most relations have a few columns with few
+distinct values, so the runs compress well. At the end of the file is a sparse index: each block's offset, size and the first value of its
+first row. The index is small enough to keep in memory for any file, and a call with its first argument bound binary searches it for the few
+blocks that can hold matching rows. Any other call scans every block.
+
+	:- external reading( Sensor, Hour, Value ) in 'readings.table'.
+
+WriteTable() sorts the rows in memory; a relation too big even for that would be written as sorted runs and merged, which is left out here.
+It only takes ground facts of one arity, and returns false for anything else. Rows are matched by comparing encoded bytes, and a variable in
+a stored row would never compare equal to the value a call has in its place.
+*/
+
+const uint32_t	gTableMagic = 0x54464c50;		// "PLFT"
+const size_t	gBlockRows = 1024;
+
+typedef std::vector<std::string>	Row;		// one encoded value per argument
+
+void Put(std::string& Out, uint32_t Value)
+{
+	Out.append((const char*)&Value, sizeof(Value));
+}
+
+void Put(std::string& Out, uint64_t Value)
+{
+	Out.append((const char*)&Value, sizeof(Value));
+}
+
+bool WriteTable(const char* File, std::vector<Term*>& Facts)
+{
+	if (Facts.empty())
+	{
+		return false;
+	}
+	uint32_t arity = Deref(Facts[0])->mAtom.mArity;
+	std::vector<Row> rows;
+	for (Term* f : Facts)
+	{
+		f = Deref(f);
+		if (f->mType != eAtom || (uint32_t)f->mAtom.mArity != arity || !Ground(f))
+		{
+			return false;
+		}
+		Row row;
+		for (uint32_t i = 0; i < arity; i++)
+		{
+			std::map<Term*, uint32_t> vars;
+			row.emplace_back();
+			Encode(f->mAtom.mTerms[i], row.back(), vars);
+		}
+		rows.push_back(row);
+	}
+	std::sort(rows.begin(), rows.end());
+
+	std::string out;
+	std::string index;
+	uint64_t blocks = (rows.size() + gBlockRows - 1) / gBlockRows;
+	Put(out, gTableMagic);
+	Put(out, arity);
+	Put(out, (uint64_t)rows.size());
+	Put(out, blocks);
+	Put(out, (uint64_t)0);		// where the index starts, filled in below
+	for (size_t first = 0; first < rows.size(); first += gBlockRows)
+	{
+		size_t last = std::min(first + gBlockRows, rows.size());
+		uint64_t offset = out.size();
+		for (uint32_t c = 0; c < arity; c++)
+		{
+			std::string column;
+			uint32_t runs = 0;
+			for (size_t r = first; r < last;)
+			{
+				size_t end = r;
+				while (end < last && rows[end][c] == rows[r][c])
+				{
+					end++;
+				}
+				Put(column, (uint32_t)(end - r));
+				Put(column, (uint32_t)rows[r][c].size());
+				column += rows[r][c];
+				runs++;
+				r = end;
+			}
+			Put(out, runs);
+			out += column;
+		}
+
+		Put(index, offset);
+		Put(index, (uint32_t)(out.size() - offset));
+		Put(index, (uint32_t)(last - first));
+		Put(index, (uint32_t)rows[first][0].size());
+		index += rows[first][0];
+	}
+
+	uint64_t at = out.size();
+	memcpy(&out[sizeof(uint32_t) * 2 + sizeof(uint64_t) * 2], &at, sizeof(at));
+	out += index;
+
+	std::ofstream file(File, std::ios::binary | std::ios::trunc);
+	file.write(out.data(), out.size());
+	return (bool)file.flush();
+}
+
+/*
+Blocks are read with pread() into a buffer cache shared by every table, which evicts the least recently used once it holds more than
+gCacheBudget bytes - so memory use is bounded however large the tables are. A scan holds on to the block it is reading, so eviction never
+pulls one out from under it. When a scan moves on to the next block, it asks the kernel to start reading the gReadahead blocks after that one
+too, so a sequential scan finds them already on their way.
+*/
+
+struct Block
+{
+	std::vector<Row>	mRows;
+	size_t				mBytes;
+};
+
+struct External
+{
+	int						mFile;
+	uint32_t				mArity;
+	std::vector<uint64_t>	mOffsets;
+	std::vector<uint32_t>	mSizes;
+	std::vector<std::string>	mFirst;		// the first value of each block's first row
+
+	~External();
+};
+
+struct BlockCache
+{
+	typedef std::pair<External*, size_t>	Key;
+
+	std::mutex															mLock;
+	std::list<std::pair<Key, std::shared_ptr<Block>>>					mRecent;
+	std::map<Key, std::list<std::pair<Key, std::shared_ptr<Block>>>::iterator>	mIndex;
+	size_t																mBytes;
+};
+
+BlockCache&				gBlockCache = *new BlockCache();		// never destroyed, as a table can outlive it at exit
+size_t					gCacheBudget = 64 << 20;
+int						gReadahead = 4;
+std::atomic<long long>	gBlockReads(0);
+
+/*
+A table goes when the last thing using it lets go - its predicate, when it is declared again, and any scan still running through it, which
+holds on to it for that reason. Its blocks are evicted from the cache then, as a table made later can be given the same address, and would
+otherwise be handed the old one's blocks.
+*/
+
+External::~External()
+{
+	close(mFile);
+	BlockCache& cache = gBlockCache;
+	std::lock_guard<std::mutex> lock(cache.mLock);
+	for (auto it = cache.mRecent.begin(); it != cache.mRecent.end();)
+	{
+		if (it->first.first != this)
+		{
+			++it;
+			continue;
+		}
+		cache.mBytes -= it->second->mBytes;
+		cache.mIndex.erase(it->first);
+		it = cache.mRecent.erase(it);
+	}
+}
+
+std::shared_ptr<Block> ReadBlock(External* T, size_t B)
+{
+	std::string data(T->mSizes[B], '\0');
+	if (pread(T->mFile, &data[0], data.size(), T->mOffsets[B]) != (ssize_t)data.size())
+	{
+		return nullptr;
+	}
+	gBlockReads++;
+
+	auto block = std::make_shared<Block>();
+	block->mBytes = sizeof(Block);
+	const char* p = data.data();
+	const char* end = p + data.size();
+	for (uint32_t c = 0; c < T->mArity; c++)
+	{
+		uint32_t runs;
+		if (end - p < (long)sizeof(runs))
+		{
+			return nullptr;
+		}
+		memcpy(&runs, p, sizeof(runs));
+		p += sizeof(runs);
+		size_t r = 0;
+		for (uint32_t i = 0; i < runs; i++)
+		{
+			uint32_t count;
+			uint32_t length;
+			if (end - p < (long)(sizeof(count) + sizeof(length)))
+			{
+				return nullptr;
+			}
+			memcpy(&count, p, sizeof(count));
+			memcpy(&length, p + sizeof(count), sizeof(length));
+			p += sizeof(count) + sizeof(length);
+			if (end - p < (long)length)
+			{
+				return nullptr;
+			}
+			for (uint32_t j = 0; j < count; j++, r++)
+			{
+				if (c == 0)
+				{
+					block->mRows.emplace_back();
+				}
+				if (r >= block->mRows.size())
+				{
+					return nullptr;
+				}
+				block->mRows[r].emplace_back(p, length);
+				block->mBytes += length + sizeof(std::string);
+			}
+			p += length;
+		}
+	}
+	return block;
+}
+
+std::shared_ptr<Block> Fetch(External* T, size_t B)
+{
+	BlockCache& cache = gBlockCache;
+	BlockCache::Key key(T, B);
+	{
+		std::lock_guard<std::mutex> lock(cache.mLock);
+		auto it = cache.mIndex.find(key);
+		if (it != cache.mIndex.end())
+		{
+			cache.mRecent.splice(cache.mRecent.begin(), cache.mRecent, it->second);
+			return it->second->second;
+		}
+	}
+
+	std::shared_ptr<Block> block = ReadBlock(T, B);
+	if (block == nullptr)
+	{
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(cache.mLock);
+	if (cache.mIndex.count(key) == 0)
+	{
+		cache.mRecent.push_front({ key, block });
+		cache.mIndex[key] = cache.mRecent.begin();
+		cache.mBytes += block->mBytes;
+		while (cache.mBytes > gCacheBudget && cache.mRecent.size() > 1)
+		{
+			cache.mBytes -= cache.mRecent.back().second->mBytes;
+			cache.mIndex.erase(cache.mRecent.back().first);
+			cache.mRecent.pop_back();
+		}
+	}
+	return block;
+}
+
+void Readahead(External* T, size_t B)
+{
+	size_t last = std::min(B + gReadahead, T->mOffsets.size() - 1);
+	if (B + 1 <= last)
+	{
+		uint64_t from = T->mOffsets[B + 1];
+		posix_fadvise(T->mFile, from, T->mOffsets[last] + T->mSizes[last] - from, POSIX_FADV_WILLNEED);
+	}
+}
+
+/*
+A Cursor is a call's place in its scan. Rows are tested against the call's bound arguments by comparing encoded bytes, and only a row that
+passes is decoded into a term and unified - so rows that can't match cost no terms and, more to the point here, no nesting of continuations.
+Each row looked at still counts as an inference, though, so a scan through millions of rows that match nothing can be halted, cancelled or
+paused like any other search.
+*/
+
+struct Cursor
+{
+	std::shared_ptr<External>	mTable;
+	Term*					mGoal;
+	std::vector<std::string>	mBound;		// the encoding of each ground argument of the goal, or empty
+	size_t					mBlock;
+	size_t					mLast;
+	size_t					mRow;
+	std::shared_ptr<Block>	mData;
+};
+
+void Scan(std::shared_ptr<Cursor> C, Continuation K, Retry R)
+{
+	for (; C->mBlock <= C->mLast; C->mBlock++, C->mRow = 0, C->mData = nullptr)
+	{
+		if (C->mData == nullptr)
+		{
+			C->mData = Fetch(C->mTable.get(), C->mBlock);
+			Readahead(C->mTable.get(), C->mBlock);
+			if (C->mData == nullptr)
+			{
+				break;
+			}
+		}
+
+		std::vector<Row>& rows = C->mData->mRows;
+		while (C->mRow < rows.size())
+		{
+			if (Halted())
+			{
+				return;
+			}
+			Row& row = rows[C->mRow++];
+			bool match = true;
+			for (size_t i = 0; i < row.size() && match; i++)
+			{
+				match = C->mBound[i].empty() || C->mBound[i] == row[i];
+			}
+			if (!match)
+			{
+				continue;
+			}
+
+			Term* fact = new Term(*C->mGoal);
+			for (size_t i = 0; i < row.size(); i++)
+			{
+				std::vector<Term*> vars;
+				const char* in = row[i].data();
+				fact->mAtom.mTerms[i] = Decode(in, in + row[i].size(), vars);
+			}
+			int index = gTrail.mTrail.size();
+			Unify(C->mGoal, fact, K, [C, K, R, index]() {
+				gTrail.UnWind(index);
+				Scan(C, K, R);
+			});
+			return;
+		}
+	}
+	R();
+}
+
+void ExternalCall(Predicate* P, Term* Goal, Continuation K, Retry R)
+{
+	External* t = P->mExternal.get();
+	auto cursor = std::make_shared<Cursor>();
+	cursor->mTable = P->mExternal;
+	cursor->mGoal = Goal;
+	cursor->mRow = 0;
+	for (uint32_t i = 0; i < t->mArity; i++)
+	{
+		cursor->mBound.emplace_back();
+		if (Ground(Goal->mAtom.mTerms[i]))
+		{
+			std::map<Term*, uint32_t> vars;
+			Encode(Goal->mAtom.mTerms[i], cursor->mBound.back(), vars);
+		}
+	}
+
+	cursor->mBlock = 0;
+	cursor->mLast = t->mOffsets.size() - 1;
+	const std::string& key = cursor->mBound[0];
+	if (!key.empty())
+	{
+		auto first = std::lower_bound(t->mFirst.begin(), t->mFirst.end(), key);
+		auto last = std::upper_bound(t->mFirst.begin(), t->mFirst.end(), key);
+		cursor->mBlock = first == t->mFirst.begin() ? 0 : first - t->mFirst.begin() - 1;
+		if (last == t->mFirst.begin())
+		{
+			R();
+			return;
+		}
+		cursor->mLast = last - t->mFirst.begin() - 1;
+	}
+	Scan(cursor, K, R);
+}
+
+/*
+DeclareExternal() opens a table file and reads its index; it returns false if the file isn't a table of the right arity.
+*/
+
+bool DeclareExternal(const char* Name, const char* File)
+{
+	int f = open(File, O_RDONLY);
+	if (f < 0)
+	{
+		return false;
+	}
+
+	uint32_t header[2];
+	uint64_t counts[3];
+	auto external = std::make_shared<External>();
+	external->mFile = f;
+	bool ok = pread(f, header, sizeof(header), 0) == sizeof(header) &&
+		pread(f, counts, sizeof(counts), sizeof(header)) == sizeof(counts) &&
+		header[0] == gTableMagic && counts[1] > 0;
+	std::string name = Name;
+	ok = ok && name.substr(name.find('/') + 1) == std::to_string(header[1]);
+
+	off_t size = lseek(f, 0, SEEK_END);
+	std::string index(ok && (off_t)counts[2] < size ? size - counts[2] : 0, '\0');
+	ok = ok && !index.empty() && pread(f, &index[0], index.size(), counts[2]) == (ssize_t)index.size();
+	const char* p = index.data();
+	const char* end = p + index.size();
+	for (uint64_t b = 0; ok && b < counts[1]; b++)
+	{
+		uint64_t offset;
+		uint32_t sizes[3];		// size, rows, length of the first value
+		ok = end - p >= (long)(sizeof(offset) + sizeof(sizes));
+		if (ok)
+		{
+			memcpy(&offset, p, sizeof(offset));
+			memcpy(sizes, p + sizeof(offset), sizeof(sizes));
+			p += sizeof(offset) + sizeof(sizes);
+			ok = end - p >= (long)sizes[2];
+		}
+		if (ok)
+		{
+			external->mOffsets.push_back(offset);
+			external->mSizes.push_back(sizes[0]);
+			external->mFirst.emplace_back(p, sizes[2]);
+			p += sizes[2];
+		}
+	}
+	if (!ok)
+	{
+		return false;		// and the file is closed as external goes
+	}
+
+	external->mArity = header[1];
+	posix_fadvise(f, 0, 0, POSIX_FADV_SEQUENTIAL);
+	gProgram[Name].mExternal = external;
+	return true;
+}
+
+/* 
+An illustration. This performs:
+
+	member( Item, [ cat, dog, frog ]),
+	member( Item, [ cat, monkey, frog ]).
+	
+This binds Item to list members common to both lists. In this case it prints cat first, followed by from
+
+It then picks an X from the first list and a Y from the second minimising the combined length of their names. Bound() prunes each X that is
+already at least as long as the best pair so far, before the second list is even looked at.
+
+Then it asks the first question again of a portfolio of four engines, each trying the lists in its own order, and prints whichever common
+member is found first.
+
+Then it loads capital/2, member/2 and a pair of wrappers around capital/2 as clauses, unfolds the wrappers, reports which predicates the analysis found to be deterministic, and looks up the capital of
+spain - without leaving a choice point behind. member/2 is declared as member( ?, + ), and the modes inferred from that are reported before the
+first question is asked once more, this time of the interpreted member. capital( Country, City ) is then prepared once and run for two
+countries. A conjunction over capital/2 and borders/2 is reordered so the selective goal runs first - and once more behind a fact with a
+variable in it, which binds nothing and so leaves capital/2 last. Then capital/2 is called for a whole batch of countries at once. Finally reach/2 is materialised over a two edge graph, and an edge is added - the new answers are
+propagated into the view, and a query over it sees them. path/2 is the same relation written left recursively and tabled; it is asked
+twice around an unrelated assert, which leaves its table alone, and once more after an edge is added, which doesn't. Last, a standing query
+for two hop routes is told about the one new route another edge makes, and a memoised wrapper around capital/2 is asked the same thing
+twice either side of an assert to capital/2, which empties its cache. Then a scheduler runs an endless count through nat/1 as an engine
+alongside three capital lookups with a higher weight; the lookups finish in their first slice while the count is held to its limit. Last
+of all, a query server is started on a Unix socket and a load generator sends it a thousand capital/2 queries down each of four
+connections, followed by two queries that search forever and are shed when they overrun their inference budgets. city/2 is then sharded
+over three child processes by country: looking up the cities of france goes to one shard, and asking for every city gathers from all three.
+Finally the map of australia is coloured with three colours by four worker processes stealing work from each other, and then again by
+a single search that is checkpointed to a file after its fifth colouring and restored from it to find the rest. Then four thousand zone/2
+facts are written to a table file and read back through an external predicate: looking up one station reads one block, and finding every
+station in a zone reads them all. Eleven engines then each read four bytes of a small text file at once, suspending while their reads are
+in flight, and the pieces are put back together in order. Last, a twenty thousand line log is searched as a lazy list: finding an early
+entry reads only the first chunk of the file, and that chunk is freed once the search backtracks past it.
+
+*/
+
+
+int main()
+{
+	Term* list =  mkAtom(".", mkAtom("cat"), mkAtom(".", mkAtom("dog"),    mkAtom(".", mkAtom("frog"), mkAtom("[]"))));
+	Term* list2 = mkAtom(".", mkAtom("cat"), mkAtom(".", mkAtom("monkey"), mkAtom(".", mkAtom("frog"), mkAtom("[]"))));
+	Term* item =  mkVar(); 
+
+	Member0(item, list, [item, list2](Retry R) {
+		Member0(item, list2, [item](Retry R) { Print(item); R(); }, R); },
+		[]() {});
+	printf("\n");
+
+	Term* x = mkVar();
+	Term* y = mkVar();
+	Objective cost = [x, y]() {
+		Term* tx = Deref(x);
+		Term* ty = Deref(y);
+		return (tx->mType == eAtom ? (int)strlen(tx->mAtom.mName) : 0) + (ty->mType == eAtom ? (int)strlen(ty->mAtom.mName) : 0);
+	};
+	Incumbent best;
+
+	Minimise([x, y, list, list2, cost, &best](Continuation K, Retry R) {
+		Member0(x, list, [y, list2, cost, &best, K](Retry R) {
+			Bound(cost, &best, [y, list2, K](Retry R) { Member0(y, list2, K, R); }, R); }, R); },
+		cost, &best, [x, y](Retry R) { Print(x); Print(y); printf("\n"); R(); },
+		[]() {});
+
+	Portfolio([list, list2](Term* Answer, Continuation K, Retry R) {
+		MemberOr(Answer, list, [Answer, list2, K](Retry R) { MemberOr(Answer, list2, K, R); }, R); },
+		4, eLuby, 16, [](Term* Answer) { Print(Answer); printf("\n"); });
+
+	Term* A = mkVar();
+	Term* H = mkVar();
+	Term* T = mkVar();
+	Assert(mkAtom("capital", mkAtom("france"), mkAtom("paris")));
+	Assert(mkAtom("capital", mkAtom("spain"), mkAtom("madrid")));
+	Assert(mkAtom("capital", mkAtom("italy"), mkAtom("rome")));
+	Assert(mkAtom("member", H, mkAtom(".", H, mkVar())));
+	Assert(mkAtom("member", A, mkAtom(".", mkVar(), T)), { mkAtom("member", A, T) });
+	Term* C = mkVar();
+	Term* G = mkVar();
+	Assert(mkAtom("spanish_capital", C), { mkAtom("capital", mkAtom("spain"), C) });
+	Assert(mkAtom("greeting", G), { mkAtom("spanish_capital", G) });
+	Unfold();
+	ReportDeterminism();
+	DeclareMode(mkAtom("member", mkAtom("?"), mkAtom("+")));
+	ReportModes();
+
+	Term* capital = mkVar();
+	Solve(mkAtom("capital", mkAtom("spain"), capital), [capital](Retry R) { Print(capital); printf("\n"); R(); }, []() {});
+	Solve(mkAtom("greeting", capital), [capital](Retry R) { Print(capital); printf("\n"); R(); }, []() {});
+
+	Term* country = mkVar();
+	Term* city = mkVar();
+	Prepared* lookup = Prepare({ mkAtom("capital", country, city) }, { country });
+	Run(lookup, { mkAtom("italy") }, [city](Retry R) { Print(city); R(); }, []() {});
+	Run(lookup, { mkAtom("france") }, [city](Retry R) { Print(city); R(); }, []() { printf("\n"); });
+
+	Assert(mkAtom("borders", mkAtom("france"), mkAtom("spain")));
+	Assert(mkAtom("borders", mkAtom("spain"), mkAtom("france")));
+	Assert(mkAtom("borders", mkAtom("france"), mkAtom("italy")));
+	Assert(mkAtom("borders", mkAtom("italy"), mkAtom("france")));
+	std::vector<Term*> neighbour = Reorder({ mkAtom("capital", country, city), mkAtom("borders", country, mkAtom("spain")) });
+	printf("%s before %s: ", Functor(neighbour[0]).c_str(), Functor(neighbour[1]).c_str());
+	Run(Prepare(neighbour, {}), {}, [city](Retry R) { Print(city); R(); }, []() { printf("\n"); });
+	Term* drink = mkVar();
+	Assert(mkAtom("likes", mkVar(), mkAtom("tea")));		// binds nothing, so capital/2 still has to scan
+	std::vector<Term*> drinks = Reorder({ mkAtom("likes", country, drink), mkAtom("capital", country, city), mkAtom("borders", mkVar(), mkAtom("spain")) });
+	printf("%s before %s before %s\n", Functor(drinks[0]).c_str(), Functor(drinks[1]).c_str(), Functor(drinks[2]).c_str());
+
+	std::vector<Term*> countries = { mkAtom("spain"), mkAtom("italy"), mkAtom("germany") };
+	Columns capitals = BatchCall(mkAtom("capital", country, city), 0, countries);
+	for (size_t i = 0; i < capitals.mRows.size(); i++)
+	{
+		printf("%zu:", capitals.mRows[i]);
+		Print(capitals.mValues[1][i]);
+	}
+	printf("\n");
+	Assert(mkAtom("twin", mkAtom("a"), mkAtom("a")));
+	Assert(mkAtom("twin", mkAtom("a"), mkAtom("b")));
+	std::vector<Term*> twins = { mkAtom("a") };
+	Term* same = mkVar();
+	printf("%zu twin rows\n", BatchCall(mkAtom("twin", same, same), 0, twins).mRows.size());
+
+	Term* X0 = mkVar();
+	Term* Y0 = mkVar();
+	Term* X1 = mkVar();
+	Term* Y1 = mkVar();
+	Term* Z1 = mkVar();
+	Assert(mkAtom("edge", mkAtom("a"), mkAtom("b")));
+	Assert(mkAtom("edge", mkAtom("b"), mkAtom("c")));
+	Assert(mkAtom("reach", X0, Y0), { mkAtom("edge", X0, Y0) });
+	Assert(mkAtom("reach", X1, Z1), { mkAtom("edge", X1, Y1), mkAtom("reach", Y1, Z1) });
+	Materialise("reach/2");
+	Assert(mkAtom("edge", mkAtom("c"), mkAtom("d")));
+	Term* reached = mkVar();
+	Solve(mkAtom("reach", mkAtom("a"), reached), [reached](Retry R) { Print(reached); R(); }, []() { printf("\n"); });
+
+	Term* X2 = mkVar();
+	Term* Y2 = mkVar();
+	Term* Z2 = mkVar();
+	Term* X3 = mkVar();
+	Term* Y3 = mkVar();
+	DeclareTabled("path/2");
+	Assert(mkAtom("path", X2, Y2), { mkAtom("path", X2, Z2), mkAtom("edge", Z2, Y2) });
+	Assert(mkAtom("path", X3, Y3), { mkAtom("edge", X3, Y3) });
+	Solve(mkAtom("path", mkAtom("a"), reached), [reached](Retry R) { Print(reached); R(); }, []() { printf("\n"); });
+	Assert(mkAtom("capital", mkAtom("germany"), mkAtom("berlin")));
+	Solve(mkAtom("path", mkAtom("a"), reached), [reached](Retry R) { Print(reached); R(); }, []() { printf("\n"); });
+	Assert(mkAtom("edge", mkAtom("d"), mkAtom("e")));
+	Solve(mkAtom("path", mkAtom("a"), reached), [reached](Retry R) { Print(reached); R(); }, []() { printf("\n"); });
+	printf("%lld table evaluations\n", gEvaluations);
+	Term* from = mkVar();
+	Run(Prepare({ mkAtom("path", from, reached) }, { from }), { mkAtom("a") }, [reached](Retry R) { Print(reached); R(); }, []() {
+		printf(" prepared, %lld table evaluations\n", gEvaluations); });
+
+	Term* A2 = mkVar();
+	Term* B2 = mkVar();
+	Term* C2 = mkVar();
+	Subscribe(mkAtom("hop", A2, C2), { mkAtom("edge", A2, B2), mkAtom("edge", B2, C2) }, [](Term* Answer) { Print(Answer); printf("\n"); });
+	Assert(mkAtom("edge", mkAtom("e"), mkAtom("f")));
+
+	Term* country2 = mkVar();
+	Term* city2 = mkVar();
+	DeclareMemo("lookup/2", 1 << 20);
+	Assert(mkAtom("lookup", country2, city2), { mkAtom("capital", country2, city2) });
+	for (int i = 0; i < 4; i++)
+	{
+		if (i == 2)
+		{
+			Assert(mkAtom("capital", mkAtom("portugal"), mkAtom("lisbon")));
+		}
+		Solve(mkAtom("lookup", mkAtom("spain"), city), [city](Retry R) { Print(city); R(); }, []() {});
+	}
+	printf(" %lld memo hits, %lld misses\n", gMemoHits.load(), gMemoMisses.load());
+	Term* country3 = mkVar();
+	Prepared* memoised = Prepare({ mkAtom("lookup", country3, city) }, { country3 });
+	Run(memoised, { mkAtom("italy") }, [city](Retry R) { Print(city); R(); }, []() {});
+	Run(memoised, { mkAtom("italy") }, [city](Retry R) { Print(city); R(); }, []() {});
+	printf(" prepared, %lld memo hits, %lld misses\n", gMemoHits.load(), gMemoMisses.load());
+
+	char* lights[] = { "red", "amber", "green" };
+	for (char* l : lights)
+	{
+		Assert(mkAtom("signal", mkAtom(l)));
+	}
+	DeclareUnordered("signal/1");
+	for (int i = 0; i < gReorderInterval; i++)
+	{
+		Solve(mkAtom("signal", mkAtom("green")), [](Retry R) { R(); }, []() {});
+	}
+	std::string profile = "/tmp/prologops-" + std::to_string(getpid()) + ".profile";
+	SaveProfile(profile.c_str());
+	for (char* l : lights)
+	{
+		Retract(mkAtom("signal", mkAtom(l)));
+	}
+	char* relit[] = { "blue", "amber", "red", "green" };		// the next run's program, with the clauses moved and one added
+	for (char* l : relit)
+	{
+		Assert(mkAtom("signal", mkAtom(l)));
+	}
+	LoadProfile(profile.c_str());
+	unlink(profile.c_str());
+	Predicate& signal = gProgram["signal/1"];
+	for (size_t i : *std::atomic_load(&signal.mOrder))
+	{
+		printf("%s ", Deref(signal.mClauses[i].mHead->mAtom.mTerms[0])->mAtom.mName);
+	}
+	printf("tried in that order after reloading the profile\n");
+
+	Term* n = mkVar();
+	Assert(mkAtom("nat", mkAtom("z")));
+	Assert(mkAtom("nat", mkAtom("s", n)), { mkAtom("nat", n) });
+	Scheduler scheduler(100);
+	long long naturals = 0;
+	Spawn(scheduler, mkEngine(mkAtom("nat", mkVar()), [&naturals](Term*) { naturals++; }, 1, 5000));
+	char* lookups[] = { "spain", "italy", "france" };
+	for (char* country : lookups)
+	{
+		Spawn(scheduler, mkEngine(mkAtom("capital", mkAtom(country), mkVar()), [&naturals](Term* Answer) {
+			Print(Answer->mAtom.mTerms[1]);
+			printf(" after %lld naturals ", naturals);
+		}, 10));
+	}
+	Run(scheduler);
+	printf("\n%lld naturals\n", naturals);
+
+	std::string address = "/tmp/prologops-" + std::to_string(getpid()) + ".sock";
+	std::atomic<bool> stop(false);
+	int listener = Socket(address.c_str(), true);
+	Term* never = mkVar();
+	Assert(mkAtom("spin"), { mkAtom("nat", never), mkAtom("=", never, mkAtom("never")) });
+	std::thread server([listener, &stop]() { Serve(listener, stop); });
+	Load load = Generate(address.c_str(), 4, 1000, 16, [](int i) {
+		char* countries[] = { "spain", "italy", "france" };
+		return mkAtom("capital", mkAtom(countries[i % 3]), mkVar());
+	});
+	Policy budget = { 0, 1, 0, 2000, 0 };
+	Load shed = Generate(address.c_str(), 1, 2, 2, [](int) { return mkAtom("spin"); }, budget);
+	stop.store(true);
+	server.join();
+	unlink(address.c_str());
+	printf("%lld queries, %lld answers, %lld errors\n", load.mQueries, load.mAnswers, load.mErrors);
+	printf("%lld queries, %lld shed\n", shed.mQueries, shed.mShed);
+
+	std::vector<std::string> shards;
+	std::vector<pid_t> pids;
+	for (int i = 0; i < 3; i++)
+	{
+		shards.push_back("/tmp/prologops-" + std::to_string(getpid()) + "-shard" + std::to_string(i) + ".sock");
+		pids.push_back(Shard(shards.back()));
+	}
+	DeclareSharded("city/2", 0, shards);
+	char* cities[][2] = { { "spain", "madrid" }, { "spain", "barcelona" }, { "italy", "rome" }, { "france", "paris" }, { "france", "lyon" } };
+	for (auto& c : cities)
+	{
+		Assert(mkAtom("city", mkAtom(c[0]), mkAtom(c[1])));
+	}
+	Term* town = mkVar();
+	Solve(mkAtom("city", mkAtom("france"), town), [town](Retry R) { Print(town); R(); }, []() { printf("\n"); });
+	int towns = 0;
+	Solve(mkAtom("city", mkVar(), mkVar()), [&towns](Retry R) { towns++; R(); }, []() {});
+	printf("%d cities across %d shards", towns, (int)shards.size());
+	StopShard(pids[1], shards[1]);
+	towns = 0;
+	gShardsLost = 0;
+	Solve(mkAtom("city", mkVar(), mkVar()), [&towns](Retry R) { towns++; R(); }, []() {});
+	printf(", %d with one stopped and %d lost\n", towns, gShardsLost);
+	gShardsLost = 0;
+	for (int i = 0; i < 3; i += 2)
+	{
+		StopShard(pids[i], shards[i]);
+	}
+
+	char* colours[] = { "red", "green", "blue" };
+	for (char* a : colours)
+	{
+		Assert(mkAtom("colour", mkAtom(a)));
+		for (char* b : colours)
+		{
+			if (a != b)
+			{
+				Assert(mkAtom("differ", mkAtom(a), mkAtom(b)));
+			}
+		}
+	}
+	Term* wa = mkVar();
+	Term* nt = mkVar();
+	Term* sa = mkVar();
+	Term* q = mkVar();
+	Term* nsw = mkVar();
+	Term* v = mkVar();
+	Term* t = mkVar();
+	std::vector<Term*> regions = { wa, nt, sa, q, nsw, v, t };
+	std::pair<Term*, Term*> borders[] = { { wa, nt }, { wa, sa }, { nt, sa }, { nt, q }, { sa, q }, { sa, nsw }, { sa, v }, { q, nsw }, { nsw, v } };
+	std::vector<Term*> colouring;
+	for (Term* r : regions)
+	{
+		colouring.push_back(mkAtom("colour", r));
+	}
+	for (auto& b : borders)
+	{
+		colouring.push_back(mkAtom("differ", b.first, b.second));
+	}
+	long long colourings = Distribute(List(regions.begin(), regions.end()), colouring, 4, [](Term*) { return true; });
+	printf("%lld colourings\n", colourings);
+
+	std::string checkpoint = "/tmp/prologops-" + std::to_string(getpid()) + ".checkpoint";
+	Search search;
+	if (Begin(search, List(regions.begin(), regions.end()), colouring))
+	{
+		Continue(search, LLONG_MAX, [&search](Term*) { return search.mAnswers < 5; });
+		Search resumed;
+		if (!Checkpoint(search, checkpoint.c_str()))
+		{
+			printf("checkpoint failed\n");
+		}
+		else if (Restore(resumed, checkpoint.c_str()))
+		{
+			Continue(resumed, LLONG_MAX, [](Term*) { return true; });
+			printf("%lld colourings after restoring at %lld\n", resumed.mAnswers, search.mAnswers);
+		}
+	}
+	unlink(checkpoint.c_str());
+
+	std::vector<Term*> stations;
+	for (int i = 0; i < 4000; i++)
+	{
+		stations.push_back(mkAtom("zone", mkAtom(Intern("station" + std::to_string(i))), mkAtom(Intern("z" + std::to_string(i % 16)))));
+	}
+	std::string table = "/tmp/prologops-" + std::to_string(getpid()) + ".table";
+	WriteTable(table.c_str(), stations);
+	DeclareExternal("zone/2", table.c_str());
+	Term* zone = mkVar();
+	Solve(mkAtom("zone", mkAtom("station42"), zone), [zone](Retry R) { Print(zone); R(); }, []() {});
+	printf(" from %lld block\n", gBlockReads.load());
+	int stationsInZone = 0;
+	Solve(mkAtom("zone", mkVar(), mkAtom("z3")), [&stationsInZone](Retry R) { stationsInZone++; R(); }, []() {});
+	printf("%d stations in z3 from %lld blocks, ", stationsInZone, gBlockReads.load());
+	size_t cached = gBlockCache.mRecent.size();
+	std::vector<Term*> moved = { mkAtom("zone", mkAtom("station42"), mkAtom("z99")) };
+	WriteTable(table.c_str(), moved);
+	DeclareExternal("zone/2", table.c_str());
+	Solve(mkAtom("zone", mkAtom("station42"), zone), [zone](Retry R) { Print(zone); R(); }, []() {});
+	printf(" after rewriting it, with %d of the %d old blocks still cached\n", (int)gBlockCache.mRecent.size() - 1, (int)cached);
+	unlink(table.c_str());
+
+	std::string text = "/tmp/prologops-" + std::to_string(getpid()) + ".txt";
+	std::ofstream(text) << "the quick brown fox jumps over the lazy dog";
+	Scheduler readers(100);
+	std::vector<std::string> chunks(11);
+	for (int i = 0; i < 11; i++)
+	{
+		Term* chunk = mkVar();
+		Term* read = mkAtom("read_bytes", mkAtom(Intern(text)), mkAtom(Intern(std::to_string(i * 4))), mkAtom("4"), chunk);
+		Spawn(readers, mkEngine(read, [&chunks, chunk, i](Term*) { chunks[i] = Deref(chunk)->mAtom.mName; }));
+	}
+	Run(readers);
+	for (std::string& chunk : chunks)
+	{
+		printf("%s", chunk.c_str());
+	}
+	printf(" from %d reads\n", (int)chunks.size());
+	unlink(text.c_str());
+
+	std::string log = "/tmp/prologops-" + std::to_string(getpid()) + ".log";
+	{
+		std::ofstream out(log);
+		for (int i = 0; i < 20000; i++)
+		{
+			out << "entry" << i << "\n";
+		}
+	}
+	Term* entry = mkVar();
+	Term* entries = mkVar();
+	Assert(mkAtom("logged", entry), { mkAtom("file_lines", mkAtom(Intern(log)), entries), mkAtom("member", entry, entries), mkAtom("!") });
+	Solve(mkAtom("logged", mkAtom("entry42")), [](Retry R) { printf("entry42 found in %lld chunk", gChunksRead.load()); R(); }, []() {});
+	printf(", %lld still held\n", gChunksHeld.load());
+	gStreamChunk = 1 << 10;
+	long long walked = 0, peak = 0;
+	Solve(mkAtom("file_line", mkAtom(Intern(log)), entry), [&walked, &peak](Retry R) {
+		walked++;
+		peak = std::max(peak, gChunksHeld.load());
+		if (walked < 2000)
+		{
+			R();
+		} },
+		[]() {});
+	printf("%lld lines walked holding at most %lld chunk, %lld after\n", walked, peak, gChunksHeld.load());
+	gStreamChunk = 64 << 10;
+	unlink(log.c_str());
+
+	Term* common = mkVar();
+	Solve(mkAtom("member", common, list), [common, list2](Retry R) {
+		Solve(mkAtom("member", common, list2), [common](Retry R) { Print(common); R(); }, R); },
+		[]() { printf("\n"); });
+
+#ifdef PROLOGOPS_STATS
+	printf("%lld derefs, average chain %.2f\n", gDerefs, gDerefs ? (double)gDerefHops / gDerefs : 0.0);
+#endif
+	printf("%lld choice points, %lld deterministic calls, %lld closures\n", gChoicePoints, gDeterministicCalls, gClosures);
 
     return 0;
 }